@@ -0,0 +1,202 @@
+#!/usr/bin/env python
+"""Benchmark suite for py-radix.
+
+Builds synthetic DFZ-shaped tables (prefix length distributions
+modelled on a full BGP feed) and times the core operations, printing
+ns/op per workload plus peak RSS. Use --json for machine-readable
+output that can be diffed across releases:
+
+    python bench/bench.py --json > after.json
+
+The prefix sets are generated from a fixed seed, so successive runs
+measure the same workload.
+"""
+
+from __future__ import print_function
+
+import argparse
+import gc
+import json
+import random
+import resource
+import socket
+import struct
+import sys
+import time
+
+import radix
+
+# Share of table by prefix length, roughly a current IPv4/IPv6 DFZ
+V4_PREFIXLEN_DIST = [
+    (8, 0.01), (16, 0.04), (17, 0.01), (18, 0.02), (19, 0.04),
+    (20, 0.06), (21, 0.06), (22, 0.13), (23, 0.09), (24, 0.54),
+]
+V6_PREFIXLEN_DIST = [
+    (29, 0.02), (32, 0.12), (36, 0.06), (40, 0.08), (44, 0.07),
+    (48, 0.60), (56, 0.03), (64, 0.02),
+]
+
+
+def pick_prefixlen(rng, dist):
+    x = rng.random()
+    for plen, share in dist:
+        x -= share
+        if x <= 0:
+            return plen
+    return dist[-1][0]
+
+
+def mask_addr(addr, plen):
+    masked = bytearray(addr)
+    if plen % 8:
+        masked[plen // 8] &= 0xff << (8 - plen % 8)
+    for i in range((plen + 7) // 8, len(masked)):
+        masked[i] = 0
+    return bytes(masked)
+
+
+def gen_table(rng, n, v6_share=0.2):
+    """Return a list of (packed, prefixlen) tuples, deduplicated."""
+    seen = set()
+    out = []
+    while len(out) < n:
+        if rng.random() < v6_share:
+            plen = pick_prefixlen(rng, V6_PREFIXLEN_DIST)
+            addr = struct.pack('>QQ',
+                               0x2000000000000000 | rng.getrandbits(61),
+                               rng.getrandbits(64))
+        else:
+            plen = pick_prefixlen(rng, V4_PREFIXLEN_DIST)
+            addr = struct.pack('>I', rng.getrandbits(32))
+        key = (mask_addr(addr, plen), plen)
+        if key not in seen:
+            seen.add(key)
+            out.append(key)
+    return out
+
+
+def gen_queries(rng, table, n, hit_ratio=0.8):
+    """Addresses as strings, mostly inside table prefixes."""
+    queries = []
+    for _ in range(n):
+        if rng.random() < hit_ratio:
+            addr, plen = table[rng.randrange(len(table))]
+            addr = bytearray(addr)
+            # randomize host bits below the prefix length
+            for i in range((plen + 7) // 8, len(addr)):
+                addr[i] = rng.getrandbits(8)
+            addr = bytes(addr)
+        elif len(queries) % 5 == 0:
+            addr = struct.pack('>QQ', rng.getrandbits(64),
+                               rng.getrandbits(64))
+        else:
+            addr = struct.pack('>I', rng.getrandbits(32))
+        family = socket.AF_INET if len(addr) == 4 else socket.AF_INET6
+        queries.append(socket.inet_ntop(family, addr))
+    return queries
+
+
+def build_tree(table):
+    tree = radix.Radix()
+    for addr, plen in table:
+        tree.add(packed=addr, masklen=plen)
+    return tree
+
+
+def timeit(func, ops):
+    """Run func() once and return ns per 'ops' operations."""
+    gc.disable()
+    try:
+        start = time.time()
+        func()
+        elapsed = time.time() - start
+    finally:
+        gc.enable()
+    return elapsed * 1e9 / max(ops, 1)
+
+
+def run_benchmarks(table_size, num_queries, seed):
+    rng = random.Random(seed)
+    table = gen_table(rng, table_size)
+    queries = gen_queries(rng, table, num_queries)
+    covered_queries = [q for q in gen_queries(rng, table, 200)]
+    results = {}
+
+    tree = build_tree(table)
+    results['add'] = timeit(lambda: build_tree(table), len(table))
+
+    results['search_exact'] = timeit(
+        lambda: [tree.search_exact(packed=a, masklen=p) for a, p in table],
+        len(table))
+    results['search_best'] = timeit(
+        lambda: [tree.search_best(q) for q in queries], len(queries))
+    results['search_best_many'] = timeit(
+        lambda: tree.search_best_many(queries), len(queries))
+    results['search_worst'] = timeit(
+        lambda: [tree.search_worst(q) for q in queries], len(queries))
+    results['search_covering'] = timeit(
+        lambda: [tree.search_covering(q) for q in covered_queries],
+        len(covered_queries))
+    results['search_covered'] = timeit(
+        lambda: [tree.search_covered(q) for q in covered_queries],
+        len(covered_queries))
+    results['iterate'] = timeit(
+        lambda: sum(1 for _ in tree), len(table))
+    results['snapshot'] = timeit(lambda: tree.snapshot(), len(table))
+    snap = tree.snapshot()
+
+    def load_snap():
+        t = radix.Radix()
+        t.load_snapshot(snap)
+    results['load_snapshot'] = timeit(load_snap, len(table))
+
+    tree.freeze()
+    results['search_best_frozen'] = timeit(
+        lambda: [tree.search_best(q) for q in queries], len(queries))
+    tree.unfreeze()
+
+    def delete_all():
+        for addr, plen in table:
+            tree.delete(packed=addr, masklen=plen)
+    results['delete'] = timeit(delete_all, len(table))
+
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--size', type=int, default=100000,
+                        help='number of prefixes in the table')
+    parser.add_argument('--queries', type=int, default=100000,
+                        help='number of lookup queries per workload')
+    parser.add_argument('--seed', type=int, default=42,
+                        help='PRNG seed for table/query generation')
+    parser.add_argument('--json', action='store_true',
+                        help='emit results as JSON on stdout')
+    args = parser.parse_args()
+
+    results = run_benchmarks(args.size, args.queries, args.seed)
+    peak_rss_kb = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    if sys.platform == 'darwin':        # ru_maxrss is bytes on macOS
+        peak_rss_kb //= 1024
+
+    if args.json:
+        json.dump({
+            'impl': 'c' if hasattr(radix, '_radix') else 'python',
+            'size': args.size,
+            'queries': args.queries,
+            'seed': args.seed,
+            'peak_rss_kb': peak_rss_kb,
+            'ns_per_op': {k: round(v, 1) for k, v in results.items()},
+        }, sys.stdout, indent=2, sort_keys=True)
+        print()
+    else:
+        print('table size %d, %d queries per workload' %
+              (args.size, args.queries))
+        for name in sorted(results):
+            print('%-24s %10.1f ns/op' % (name, results[name]))
+        print('%-24s %10d KB' % ('peak RSS', peak_rss_kb))
+
+
+if __name__ == '__main__':
+    main()
@@ -1,39 +1,261 @@
 try:
     from ._radix import Radix as _Radix
+    from ._radix import RadixSnapshot as _RadixSnapshot
 except Exception:
     from .radix import Radix as _Radix
+    _RadixSnapshot = None
 
 __version__ = '0.10.0'
-__all__ = ['Radix']
+__all__ = ['Radix', 'AsyncRadix', 'SharedRadix', 'load', 'attach_shared']
 
 
 # This acts as an entrypoint to the underlying object (be it a C
 # extension or pure python representation, pickle files will work)
 class Radix(object):
-    def __init__(self):
-        self._radix = _Radix()
-        self.add = self._radix.add
-        self.delete = self._radix.delete
-        self.search_exact = self._radix.search_exact
-        self.search_best = self._radix.search_best
-        self.search_worst = self._radix.search_worst
-        self.search_covered = self._radix.search_covered
-        self.search_covering = self._radix.search_covering
-        self.nodes = self._radix.nodes
-        self.prefixes = self._radix.prefixes
+    def __init__(self, value_mode='dict'):
+        self._value_mode = value_mode
+        self._bind(_Radix(value_mode=value_mode))
+
+    # Adopt an underlying tree, exposing its methods as our own; also
+    # used to wrap trees created at the C level (e.g. by aggregate())
+    def _bind(self, rdx):
+        self._radix = rdx
+        if not hasattr(self, '_value_mode'):
+            self._value_mode = 'dict'
+        self.add = rdx.add
+        self.add_many = rdx.add_many
+        self.update = rdx.update
+        self.load_text = rdx.load_text
+        self.build = rdx.build
+        self.clear = rdx.clear
+        self.delete = rdx.delete
+        self.search_exact = rdx.search_exact
+        self.search_best = rdx.search_best
+        self.search_best_many = rdx.search_best_many
+        self.search_best_packed = rdx.search_best_packed
+        self.search_exact_packed = rdx.search_exact_packed
+        self.search_worst = rdx.search_worst
+        self.search_covered = rdx.search_covered
+        self.search_covering = rdx.search_covering
+        self.freeze = rdx.freeze
+        self.unfreeze = rdx.unfreeze
+        self.set_lpm_cache = rdx.set_lpm_cache
+        self.snapshot = rdx.snapshot
+        self.load_snapshot = rdx.load_snapshot
+        self.iternodes = rdx.iternodes
+        self.stats = rdx.stats
+        self.nodes = rdx.nodes
+        self.prefixes = rdx.prefixes
+
+    def aggregate(self, key=None):
+        """Return a new Radix with covered prefixes stripped and buddy
+        pairs merged; see _radix.Radix.aggregate for details.
+        """
+        agg = Radix.__new__(Radix)
+        agg._value_mode = self._value_mode
+        agg._bind(self._radix.aggregate(key))
+        return agg
+
+    def union(self, other):
+        res = Radix.__new__(Radix)
+        res._value_mode = self._value_mode
+        res._bind(self._radix.union(other._radix))
+        return res
+
+    def intersection(self, other):
+        res = Radix.__new__(Radix)
+        res._value_mode = self._value_mode
+        res._bind(self._radix.intersection(other._radix))
+        return res
+
+    def difference(self, other):
+        res = Radix.__new__(Radix)
+        res._value_mode = self._value_mode
+        res._bind(self._radix.difference(other._radix))
+        return res
 
     def __iter__(self):
         for elt in self._radix:
             yield elt
 
+    def __len__(self):
+        return len(self._radix)
+
+    def __contains__(self, key):
+        return key in self._radix
+
+    def __getitem__(self, key):
+        return self._radix[key]
+
+    def __setitem__(self, key, value):
+        self._radix[key] = value
+
+    def __delitem__(self, key):
+        del self._radix[key]
+
     def __getstate__(self):
-        return [(elt.prefix, elt.data) for elt in self]
+        return self._radix.__getstate__()
 
     def __setstate__(self, state):
+        if isinstance(state, tuple):
+            self._radix.__setstate__(state)
+            return
+        # Pickles from 0.10 and earlier store a list of (prefix, data)
         for prefix, data in state:
             node = self._radix.add(prefix)
             for key in data:
                 node.data[key] = data[key]
 
+    def to_shared_memory(self, name):
+        """Publish a snapshot of this tree into a shared-memory
+        segment called 'name'.
+
+        One loader process calls this once; workers in other
+        processes then use radix.attach_shared(name) to search the
+        same pages with no per-process copy of the table. Returns
+        the SharedMemory handle — keep it referenced while workers
+        are attached, and unlink() it to retire the segment.
+        """
+        from multiprocessing import shared_memory
+
+        snap = self.snapshot()
+        shm = shared_memory.SharedMemory(name=name, create=True,
+                                         size=len(snap))
+        shm.buf[:len(snap)] = snap
+        return shm
+
+    def save(self, path):
+        """Write a binary snapshot of the tree structure to 'path'.
+
+        User data dicts are not included; use pickle for those.
+        """
+        with open(path, 'wb') as f:
+            f.write(self.snapshot())
+
     def __reduce__(self):
-        return (Radix, (), self.__getstate__())
+        return (Radix, (self._value_mode,), self.__getstate__())
+
+
+class AsyncRadix(object):
+    """Asyncio adapter that keeps longest-match lookups off the event
+    loop thread.
+
+    Lookups submitted with search_best() during one loop iteration are
+    coalesced and resolved as a single Radix.search_best_many() call on
+    a worker thread, which drops the GIL for the whole batch; the loop
+    thread only completes futures. While a batch is in flight the tree
+    refuses writers, so freeze() the tree (or simply don't mutate it)
+    while lookups are pending.
+    """
+
+    def __init__(self, tree, executor=None, max_batch=8192):
+        self._tree = tree
+        self._executor = executor
+        self._max_batch = max_batch
+        self._pending = []
+        self._flush_scheduled = False
+
+    def search_best(self, address):
+        """Return an awaitable resolving to the best-match RadixNode
+        for 'address' (a CIDR string or packed bytes), or None.
+        """
+        import asyncio
+
+        loop = asyncio.get_event_loop()
+        fut = loop.create_future()
+        self._pending.append((address, fut))
+        if not self._flush_scheduled:
+            self._flush_scheduled = True
+            loop.call_soon(self._flush, loop)
+        return fut
+
+    def _flush(self, loop):
+        self._flush_scheduled = False
+        pending, self._pending = self._pending, []
+        while pending:
+            batch = pending[:self._max_batch]
+            pending = pending[self._max_batch:]
+            work = loop.run_in_executor(
+                self._executor, self._tree.search_best_many,
+                [address for address, _ in batch])
+            work.add_done_callback(
+                lambda done, batch=batch: self._complete(batch, done))
+
+    @staticmethod
+    def _complete(batch, done):
+        try:
+            results = done.result()
+        except BaseException as exc:
+            for _, fut in batch:
+                if not fut.done():
+                    fut.set_exception(exc)
+            return
+        for (_, fut), node in zip(batch, results):
+            if not fut.done():
+                fut.set_result(node)
+
+
+class SharedRadix(object):
+    """Read-only best-match search over a shared-memory tree snapshot.
+
+    The published pages are searched in place and hold no Python
+    objects (hence no refcounts to dirty them on access), so any
+    number of worker processes share a single copy of the table.
+    search_best() returns the matching prefix as a CIDR string, or
+    None; user data dicts are not part of a snapshot.
+    """
+
+    def __init__(self, shm):
+        self._shm = shm
+        self._view = None
+        if _RadixSnapshot is not None:
+            self._view = _RadixSnapshot(shm.buf)
+            self.search_best = self._view.search_best
+        else:
+            # Pure-python fallback: same interface, but each process
+            # loads its own private copy of the table.
+            self._tree = Radix()
+            self._tree.load_snapshot(bytes(shm.buf))
+
+    def search_best(self, network=None, masklen=None, packed=None):
+        node = self._tree.search_best(network, masklen, packed)
+        return node.prefix if node is not None else None
+
+    def __len__(self):
+        if self._view is not None:
+            return len(self._view)
+        return len(self._tree)
+
+    def close(self):
+        """Detach from the segment (does not unlink it)."""
+        if self._view is not None:
+            del self.search_best
+            self._view = None
+        self._shm.close()
+
+
+def attach_shared(name):
+    """Attach to a tree published with Radix.to_shared_memory() by
+    another process and return a SharedRadix search handle over it.
+    """
+    from multiprocessing import shared_memory
+
+    return SharedRadix(shared_memory.SharedMemory(name=name))
+
+
+def load(path):
+    """Load a tree saved with Radix.save().
+
+    The snapshot file is memory-mapped where possible and restored in
+    a single pass, so loading a large table is nearly instant.
+    """
+    import mmap
+
+    tree = Radix()
+    with open(path, 'rb') as f:
+        try:
+            buf = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        except (ValueError, OSError):
+            buf = f.read()
+        tree.load_snapshot(buf)
+    return tree
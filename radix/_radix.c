@@ -17,6 +17,7 @@
 #define PY_SSIZE_T_CLEAN
 #include "Python.h"
 #include "structmember.h"
+#include "pythread.h"
 #include "_radix/radix.h"
 
 /* $Id$ */
@@ -40,7 +41,9 @@
 struct _RadixObject;
 struct _RadixIterObject;
 static struct _RadixIterObject *newRadixIterObject(struct _RadixObject *);
-static PyObject *radix_Radix(PyObject *, PyObject *);
+static struct _RadixIterObject *newRadixIterObject2(struct _RadixObject *,
+    int, prefix_t *, int, int);
+static PyObject *radix_Radix(PyObject *, PyObject *, PyObject *);
 
 /* ------------------------------------------------------------------------ */
 
@@ -50,25 +53,27 @@ PyObject *radix_constructor;
 
 typedef struct {
         PyObject_HEAD
-        PyObject *user_attr;    /* User-specified attributes */
-        PyObject *network;
-        PyObject *prefix;
+        PyObject *user_attr;    /* Data dict (created lazily), or the single
+                                 * value object in value_mode='object' trees */
+        int value_mode;         /* Copied from the owning tree at creation */
+        PyObject *network;      /* Remaining objects are formatted from pfx */
+        PyObject *prefix;       /* on first access and cached here */
         PyObject *prefixlen;
         PyObject *family;
         PyObject *packed;
         radix_node_t *rn;       /* Actual radix node (pointer to parent) */
+        prefix_t pfx;           /* Copy of rn->prefix; outlives the tree node */
 } RadixNodeObject;
 
 static PyTypeObject RadixNode_Type;
 
 static RadixNodeObject *
-newRadixNodeObject(radix_node_t *rn)
+newRadixNodeObject(radix_node_t *rn, int value_mode)
 {
         RadixNodeObject *self;
-        char network[256], prefix[256];
 
         /* Sanity check */
-        if (rn == NULL || rn->prefix == NULL || 
+        if (rn == NULL || rn->prefix == NULL ||
             (rn->prefix->family != AF_INET && rn->prefix->family != AF_INET6))
                 return NULL;
 
@@ -77,26 +82,20 @@ newRadixNodeObject(radix_node_t *rn)
                 return NULL;
 
         self->rn = rn;
+        self->pfx = *rn->prefix;
+        self->value_mode = value_mode;
 
-        /* Format addresses for packing into objects */
-        prefix_addr_ntop(rn->prefix, network, sizeof(network));
-        prefix_ntop(rn->prefix, prefix, sizeof(prefix));
-
-        self->user_attr = PyDict_New();
-        self->network = PyString_FromString(network);
-        self->prefix = PyString_FromString(prefix);
-        self->prefixlen = PyInt_FromLong(rn->prefix->bitlen);
-        self->family = PyInt_FromLong(rn->prefix->family);
-        self->packed = PyString_FromStringAndSize((char*)&rn->prefix->add,
-            rn->prefix->family == AF_INET ? 4 : 16);
-
-        if (self->user_attr == NULL || self->prefixlen == NULL || 
-            self->family == NULL || self->network == NULL || 
-            self->prefix == NULL) {
-                /* RadixNode_dealloc will clean up for us */
-                Py_XDECREF(self);
-                return (NULL);          
-        }
+        /*
+         * Formatted attributes and the data dict are materialized on
+         * first access by the getters below; most nodes in a large
+         * table are never looked at, so insert stays cheap.
+         */
+        self->user_attr = NULL;
+        self->network = NULL;
+        self->prefix = NULL;
+        self->prefixlen = NULL;
+        self->family = NULL;
+        self->packed = NULL;
 
         return self;
 }
@@ -139,14 +138,204 @@ Radix_parent(RadixNodeObject *self, void *closure)
         }
         Py_RETURN_NONE;
 }
-static PyMemberDef RadixNode_members[] = {
-        {"data",        T_OBJECT, offsetof(RadixNodeObject, user_attr), READONLY},
-        {"network",     T_OBJECT, offsetof(RadixNodeObject, network),   READONLY},
-        {"prefix",      T_OBJECT, offsetof(RadixNodeObject, prefix),    READONLY},
-        {"prefixlen",   T_OBJECT, offsetof(RadixNodeObject, prefixlen), READONLY},
-        {"family",      T_OBJECT, offsetof(RadixNodeObject, family),    READONLY},
-        {"packed",      T_OBJECT, offsetof(RadixNodeObject, packed),    READONLY},
-        {NULL}
+static PyObject *
+RadixNode_data(RadixNodeObject *self, void *closure)
+{
+        if (self->value_mode) {
+                PyErr_SetString(PyExc_TypeError,
+                    "no data dict in a value_mode='object' tree; "
+                    "use node.value");
+                return NULL;
+        }
+        if (self->user_attr == NULL &&
+            (self->user_attr = PyDict_New()) == NULL)
+                return NULL;
+        Py_INCREF(self->user_attr);
+        return self->user_attr;
+}
+
+static PyObject *
+RadixNode_value_get(RadixNodeObject *self, void *closure)
+{
+        if (!self->value_mode) {
+                PyErr_SetString(PyExc_TypeError,
+                    "node.value requires a value_mode='object' tree; "
+                    "use node.data");
+                return NULL;
+        }
+        if (self->user_attr == NULL)
+                Py_RETURN_NONE;
+        Py_INCREF(self->user_attr);
+        return self->user_attr;
+}
+
+static int
+RadixNode_value_set(RadixNodeObject *self, PyObject *value, void *closure)
+{
+        if (!self->value_mode) {
+                PyErr_SetString(PyExc_TypeError,
+                    "node.value requires a value_mode='object' tree; "
+                    "use node.data");
+                return -1;
+        }
+        Py_XINCREF(value);
+        Py_XDECREF(self->user_attr);
+        self->user_attr = value;
+        return 0;
+}
+
+static PyObject *
+RadixNode_network(RadixNodeObject *self, void *closure)
+{
+        char network[256];
+
+        if (self->network == NULL) {
+                if (prefix_addr_ntop(&self->pfx, network,
+                    sizeof(network)) == NULL) {
+                        PyErr_SetString(PyExc_ValueError,
+                            "Invalid address format");
+                        return NULL;
+                }
+                if ((self->network = PyString_FromString(network)) == NULL)
+                        return NULL;
+        }
+        Py_INCREF(self->network);
+        return self->network;
+}
+
+static PyObject *
+RadixNode_prefix(RadixNodeObject *self, void *closure)
+{
+        char prefix[256];
+
+        if (self->prefix == NULL) {
+                if (prefix_ntop(&self->pfx, prefix, sizeof(prefix)) == NULL) {
+                        PyErr_SetString(PyExc_ValueError,
+                            "Invalid address format");
+                        return NULL;
+                }
+                if ((self->prefix = PyString_FromString(prefix)) == NULL)
+                        return NULL;
+        }
+        Py_INCREF(self->prefix);
+        return self->prefix;
+}
+
+static PyObject *
+RadixNode_prefixlen(RadixNodeObject *self, void *closure)
+{
+        if (self->prefixlen == NULL &&
+            (self->prefixlen = PyInt_FromLong(self->pfx.bitlen)) == NULL)
+                return NULL;
+        Py_INCREF(self->prefixlen);
+        return self->prefixlen;
+}
+
+static PyObject *
+RadixNode_family(RadixNodeObject *self, void *closure)
+{
+        if (self->family == NULL &&
+            (self->family = PyInt_FromLong(self->pfx.family)) == NULL)
+                return NULL;
+        Py_INCREF(self->family);
+        return self->family;
+}
+
+static PyObject *
+RadixNode_packed(RadixNodeObject *self, void *closure)
+{
+        if (self->packed == NULL &&
+            (self->packed = PyString_FromStringAndSize(
+            (char *)&self->pfx.add,
+            self->pfx.family == AF_INET ? 4 : 16)) == NULL)
+                return NULL;
+        Py_INCREF(self->packed);
+        return self->packed;
+}
+
+/*
+ * Subtree traversal from a node, without re-descending from the root
+ * the way search_covered() must. Both return eagerly-built lists;
+ * a node detached from its tree (deleted, or the tree was destroyed)
+ * has no subtree and yields an empty list, matching how the parent
+ * getter degrades.
+ */
+static PyObject *
+node_collect_descendants(RadixNodeObject *self, int direct_only)
+{
+        radix_node_t *stack[RADIX_MAXBITS + 1], *node;
+        RadixNodeObject *node_obj;
+        PyObject *ret;
+        int sp = 0;
+
+        if ((ret = PyList_New(0)) == NULL)
+                return NULL;
+        if (self->rn == NULL)
+                return ret;
+        if (self->rn->r != NULL)
+                stack[sp++] = self->rn->r;
+        if (self->rn->l != NULL)
+                stack[sp++] = self->rn->l;
+        while (sp > 0) {
+                node = stack[--sp];
+                if (node->prefix != NULL) {
+                        if (node->data == NULL) {
+                                if ((node_obj =
+                                    newRadixNodeObject(node,
+                                    self->value_mode)) == NULL)
+                                        goto err;
+                                node->data = node_obj;
+                        }
+                        if (PyList_Append(ret,
+                            (PyObject *)node->data) == -1)
+                                goto err;
+                        if (direct_only)
+                                continue;
+                }
+                if (node->r != NULL)
+                        stack[sp++] = node->r;
+                if (node->l != NULL)
+                        stack[sp++] = node->l;
+        }
+        return ret;
+ err:
+        Py_DECREF(ret);
+        return NULL;
+}
+
+PyDoc_STRVAR(RadixNode_children_doc,
+"RadixNode.children() -> list of RadixNode\n\
+\n\
+Returns this node's direct descendants: the covered prefixes that\n\
+have no other covering prefix between themselves and this node.");
+
+static PyObject *
+RadixNode_children(RadixNodeObject *self, PyObject *args)
+{
+        if (!PyArg_ParseTuple(args, ":children"))
+                return NULL;
+        return node_collect_descendants(self, 1);
+}
+
+PyDoc_STRVAR(RadixNode_subtree_doc,
+"RadixNode.subtree() -> list of RadixNode\n\
+\n\
+Returns every prefix covered by this node (itself excluded), in\n\
+walk order, by traversing down from the node directly rather than\n\
+re-descending from the tree root as search_covered() does.");
+
+static PyObject *
+RadixNode_subtree(RadixNodeObject *self, PyObject *args)
+{
+        if (!PyArg_ParseTuple(args, ":subtree"))
+                return NULL;
+        return node_collect_descendants(self, 0);
+}
+
+static PyMethodDef RadixNode_methods[] = {
+        {"children",    (PyCFunction)RadixNode_children, METH_VARARGS,  RadixNode_children_doc  },
+        {"subtree",     (PyCFunction)RadixNode_subtree, METH_VARARGS,   RadixNode_subtree_doc   },
+        {NULL,          NULL}           /* sentinel */
 };
 
 static PyGetSetDef node_getter[] = {
@@ -156,6 +345,21 @@ static PyGetSetDef node_getter[] = {
          "parent of node",           /* optional doc string */
          NULL                        /* optional additional data for getter and setter */
         },
+        {"data",        (getter) RadixNode_data,        NULL,
+         "user data dict",           NULL},
+        {"value",       (getter) RadixNode_value_get,
+         (setter) RadixNode_value_set,
+         "single user value (value_mode='object' trees)", NULL},
+        {"network",     (getter) RadixNode_network,     NULL,
+         "network address",          NULL},
+        {"prefix",      (getter) RadixNode_prefix,      NULL,
+         "prefix in CIDR format",    NULL},
+        {"prefixlen",   (getter) RadixNode_prefixlen,   NULL,
+         "prefix length",            NULL},
+        {"family",      (getter) RadixNode_family,      NULL,
+         "address family",           NULL},
+        {"packed",      (getter) RadixNode_packed,      NULL,
+         "packed binary address",    NULL},
         {NULL}  /* Sentinel */
 };
 
@@ -193,8 +397,8 @@ static PyTypeObject RadixNode_Type = {
         0,                      /*tp_weaklistoffset*/
         0,                      /*tp_iter*/
         0,                      /*tp_iternext*/
-        0,                      /*tp_methods*/
-        RadixNode_members,      /*tp_members*/
+        RadixNode_methods,      /*tp_methods*/
+        0,                      /*tp_members*/
         node_getter,            /*tp_getset*/
         0,                      /*tp_base*/
         0,                      /*tp_dict*/
@@ -210,10 +414,31 @@ static PyTypeObject RadixNode_Type = {
 
 /* ------------------------------------------------------------------------ */
 
+/*
+ * One slot of the optional LPM result cache: a direct-mapped table
+ * from (family, bitlen, address) to the winning tree node. Entries
+ * are validated against the tree's generation counter, so a single
+ * gen_id bump on any mutation (or relocation by freeze()) retires
+ * the whole cache without a wholesale clear.
+ */
+typedef struct _lpm_cache_ent_t {
+        u_char addr[16];
+        unsigned int gen_id;
+        u_short bitlen;
+        u_char family;          /* 0 on never-used slots */
+        radix_node_t *node;     /* may be NULL: cached miss */
+} lpm_cache_ent_t;
+
 typedef struct _RadixObject {
         PyObject_HEAD
         radix_tree_t *rt;       /* Radix tree for IPv4 & IPv6 addresses */
         unsigned int gen_id;    /* Detect modification during iterations */
+        int frozen;             /* Compacted read-only layout in effect */
+        int value_mode;         /* 0: per-node data dict, 1: single object */
+        unsigned int readers;   /* Batch lookups running without the GIL */
+        lpm_cache_ent_t *cache; /* LPM result cache, NULL when disabled */
+        unsigned int cache_mask;
+        unsigned long long cache_hits, cache_misses;
 } RadixObject;
 
 static PyTypeObject Radix_Type;
@@ -228,14 +453,87 @@ newRadixObject(void)
         if ((rt = New_Radix()) == NULL)
                 return (NULL);
         if ((self = PyObject_New(RadixObject, &Radix_Type)) == NULL) {
-                free(rt);
+                Destroy_Radix(rt, NULL, NULL);
                 return (NULL);
         }
         self->rt = rt;
         self->gen_id = 0;
+        self->frozen = 0;
+        self->value_mode = 0;
+        self->readers = 0;
+        self->cache = NULL;
+        self->cache_mask = 0;
+        self->cache_hits = self->cache_misses = 0;
         return (self);
 }
 
+/*
+ * Best-match search through the optional LPM cache. Query streams
+ * tend to repeat the same addresses for minutes, so a direct-mapped
+ * probe on (family, bitlen, address) resolves most lookups without
+ * walking the trie; misses (NULL results) are cached too. Stale
+ * entries are detected by their recorded gen_id and overwritten.
+ */
+static radix_node_t *
+cached_search_best(RadixObject *self, prefix_t *prefix)
+{
+        lpm_cache_ent_t *ent;
+        radix_node_t *node;
+        u_char *addr;
+        u_int32_t hash, word;
+        int alen, i;
+
+        if (self->cache == NULL)
+                return (radix_search_best(self->rt, prefix));
+
+        addr = (u_char *)&prefix->add;
+        alen = prefix->family == AF_INET ? 4 : 16;
+        hash = 2166136261u ^ (prefix->bitlen * 16777619u);
+        for (i = 0; i < alen; i += 4) {
+                memcpy(&word, addr + i, 4);
+                hash = (hash ^ word) * 16777619u;
+        }
+        ent = &self->cache[(hash ^ (hash >> 16)) & self->cache_mask];
+
+        if (ent->family == prefix->family &&
+            ent->bitlen == prefix->bitlen &&
+            ent->gen_id == self->gen_id &&
+            memcmp(ent->addr, addr, alen) == 0) {
+                self->cache_hits++;
+                return (ent->node);
+        }
+        self->cache_misses++;
+        node = radix_search_best(self->rt, prefix);
+        memcpy(ent->addr, addr, alen);
+        ent->gen_id = self->gen_id;
+        ent->bitlen = prefix->bitlen;
+        ent->family = prefix->family;
+        ent->node = node;
+        return (node);
+}
+
+/*
+ * Writers must be refused while the tree is frozen or while batch
+ * lookups are walking the trie with the GIL released in other
+ * threads; mutating underneath them would crash.
+ */
+static int
+check_writable(RadixObject *self)
+{
+        if (self->frozen) {
+                PyErr_SetString(PyExc_RuntimeError,
+                    "Radix tree is frozen (call unfreeze() to modify)");
+                return -1;
+        }
+        if (self->readers != 0) {
+                PyErr_SetString(PyExc_RuntimeError,
+                    "Radix tree is busy: batch readers are active in "
+                    "other threads");
+                return -1;
+        }
+        return 0;
+}
+
 /* Radix methods */
 
 static void
@@ -253,6 +551,7 @@ Radix_dealloc(RadixObject *self)
         } RADIX_TREE_WALK_END;
 
         Destroy_Radix(self->rt, NULL, NULL);
+        PyMem_Free(self->cache);
         PyObject_Del(self);
 }
 
@@ -314,7 +613,8 @@ create_add_node(RadixObject *self, prefix_t *prefix)
          * Confusing? yeah...
          */
         if (node->data == NULL) {
-                if ((node_obj = newRadixNodeObject(node)) == NULL)
+                if ((node_obj = newRadixNodeObject(node,
+                    self->value_mode)) == NULL)
                         return (NULL);
                 node->data = node_obj;
         } else
@@ -355,6 +655,8 @@ Radix_add(RadixObject *self, PyObject *args, PyObject *kw_args)
         long prefixlen = -1;
         Py_ssize_t packlen = -1;
 
+        if (check_writable(self) == -1)
+                return NULL;
         if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|zlz#:add", keywords,
             &addr, &prefixlen, &packed, &packlen))
                 return NULL;
@@ -367,132 +669,846 @@ Radix_add(RadixObject *self, PyObject *args, PyObject *kw_args)
         return node_obj;
 }
 
-PyDoc_STRVAR(Radix_delete_doc,
-"Radix.delete(network[, masklen][, packed] -> None\n\
+/*
+ * Parse one batch item -- a CIDR string or packed bytes -- into a
+ * caller-provided prefix_t. Returns 0 on success, -1 with an
+ * exception set otherwise.
+ */
+static int
+parse_prefix_item(PyObject *item, prefix_t *prefix)
+{
+        const char *errmsg = NULL, *addr;
+
+        if (PyUnicode_Check(item)) {
+                if ((addr = PyUnicode_AsUTF8(item)) == NULL)
+                        return -1;
+                if (prefix_pton_ex(prefix, addr, -1, &errmsg) == NULL) {
+                        PyErr_SetString(PyExc_ValueError, errmsg ? errmsg :
+                            "Invalid address format");
+                        return -1;
+                }
+        } else if (PyBytes_Check(item)) {
+                if (prefix_from_blob_ex(prefix,
+                    (u_char *)PyBytes_AS_STRING(item),
+                    PyBytes_GET_SIZE(item), -1) == NULL) {
+                        PyErr_SetString(PyExc_ValueError,
+                            "Invalid packed address format");
+                        return -1;
+                }
+        } else {
+                PyErr_SetString(PyExc_TypeError,
+                    "prefix must be a string or packed bytes");
+                return -1;
+        }
+        return 0;
+}
+
+PyDoc_STRVAR(Radix_add_many_doc,
+"Radix.add_many(prefixes) -> number of prefixes added\n\
 \n\
-Deletes the specified network from the radix tree.");
+Adds every prefix in 'prefixes' to the radix tree in a single call.\n\
+Each item may be a string in CIDR format or a packed binary address\n\
+(4 or 16 bytes, implying a full-length mask). This amortizes the\n\
+per-call argument parsing and is much faster than calling Radix.add\n\
+in a loop when populating a tree from a large dump.\n\
+\n\
+Returns the number of prefixes processed.");
 
 static PyObject *
-Radix_delete(RadixObject *self, PyObject *args, PyObject *kw_args)
+Radix_add_many(RadixObject *self, PyObject *args)
 {
+        PyObject *prefixes, *iter, *item;
+        prefix_t prefix_buf;
         radix_node_t *node;
         RadixNodeObject *node_obj;
-        prefix_t lprefix, *prefix;
-        static char *keywords[] = { "network", "masklen", "packed", NULL };
-
-        char *addr = NULL, *packed = NULL;
-        long prefixlen = -1;
-        Py_ssize_t packlen = -1;
+        Py_ssize_t n = 0;
 
-        if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|zlz#:delete", keywords,
-            &addr, &prefixlen, &packed, &packlen))
+        if (check_writable(self) == -1)
                 return NULL;
-        if ((prefix = args_to_prefix(&lprefix, addr, packed, packlen, prefixlen)) == NULL)
+        if (!PyArg_ParseTuple(args, "O:add_many", &prefixes))
                 return NULL;
-        if ((node = radix_search_exact(self->rt, prefix)) == NULL) {
-                PyErr_SetString(PyExc_KeyError, "no such address");
+        if ((iter = PyObject_GetIter(prefixes)) == NULL)
                 return NULL;
-        }
-        if (node->data != NULL) {
-                node_obj = node->data;
-                node_obj->rn = NULL;
-                Py_XDECREF(node_obj);
-        }
 
-        radix_remove(self->rt, node);
+        while ((item = PyIter_Next(iter)) != NULL) {
+                /* Parse into a stack prefix_t, no per-item allocation */
+                if (parse_prefix_item(item, &prefix_buf) == -1) {
+                        Py_DECREF(item);
+                        break;
+                }
+                if ((node = radix_lookup(self->rt, &prefix_buf)) == NULL) {
+                        PyErr_SetString(PyExc_MemoryError,
+                            "Couldn't add prefix");
+                        Py_DECREF(item);
+                        break;
+                }
+                if (node->data == NULL) {
+                        if ((node_obj = newRadixNodeObject(node,
+                    self->value_mode)) == NULL) {
+                                Py_DECREF(item);
+                                break;
+                        }
+                        node->data = node_obj;
+                }
+                n++;
+                Py_DECREF(item);
+        }
+        Py_DECREF(iter);
 
         self->gen_id++;
-        Py_INCREF(Py_None);
-        return Py_None;
+        if (PyErr_Occurred())
+                return NULL;
+        return PyInt_FromLong(n);
 }
 
-PyDoc_STRVAR(Radix_search_exact_doc,
-"Radix.search_exact(network[, masklen][, packed] -> RadixNode or None\n\
-\n\
-Search for the specified network in the radix tree. In order to\n\
-match, the 'prefix' must be specified exactly. Contrast with the\n\
-Radix.search_best method.\n\
+PyDoc_STRVAR(Radix_update_doc,
+"Radix.update(adds=None, deletes=None) -> None\n\
 \n\
-If no match is found, then this method returns None.");
+Applies a batch of modifications in one call: every prefix in\n\
+'deletes' is removed, then every item in 'adds' is inserted. Items\n\
+may be CIDR strings or packed binary addresses; an add item may also\n\
+be an (prefix, data) tuple whose data dict is merged into the node's\n\
+data. The whole delta bumps the iterator generation once instead of\n\
+once per entry. Deleting a missing prefix raises KeyError; entries\n\
+processed before an error stay applied.");
 
 static PyObject *
-Radix_search_exact(RadixObject *self, PyObject *args, PyObject *kw_args)
+Radix_update(RadixObject *self, PyObject *args, PyObject *kw_args)
 {
+        static char *keywords[] = { "adds", "deletes", NULL };
+        PyObject *adds = NULL, *deletes = NULL, *iter, *item, *data;
+        PyObject *dict;
+        prefix_t prefix_buf;
         radix_node_t *node;
         RadixNodeObject *node_obj;
-        prefix_t lprefix, *prefix;
-        static char *keywords[] = { "network", "masklen", "packed", NULL };
-
-        char *addr = NULL, *packed = NULL;
-        long prefixlen = -1;
-        Py_ssize_t packlen = -1;
+        int failed = 0;
 
-        if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|zlz#:search_exact", keywords,
-            &addr, &prefixlen, &packed, &packlen))
+        if (check_writable(self) == -1)
                 return NULL;
-        if ((prefix = args_to_prefix(&lprefix, addr, packed, packlen, prefixlen)) == NULL)
+        if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|OO:update",
+            keywords, &adds, &deletes))
                 return NULL;
 
-        node = radix_search_exact(self->rt, prefix);
-        if (node == NULL || node->data == NULL) {
-                Py_INCREF(Py_None);
-                return Py_None;
+        if (deletes != NULL && deletes != Py_None) {
+                if ((iter = PyObject_GetIter(deletes)) == NULL)
+                        return NULL;
+                while ((item = PyIter_Next(iter)) != NULL) {
+                        if (parse_prefix_item(item, &prefix_buf) == -1) {
+                                Py_DECREF(item);
+                                failed = 1;
+                                break;
+                        }
+                        Py_DECREF(item);
+                        if ((node = radix_search_exact(self->rt,
+                            &prefix_buf)) == NULL) {
+                                PyErr_SetString(PyExc_KeyError,
+                                    "no such address");
+                                failed = 1;
+                                break;
+                        }
+                        if (node->data != NULL) {
+                                node_obj = node->data;
+                                node_obj->rn = NULL;
+                                node->data = NULL;
+                                Py_XDECREF(node_obj);
+                        }
+                        radix_remove(self->rt, node);
+                }
+                Py_DECREF(iter);
         }
-        node_obj = node->data;
-        Py_XINCREF(node_obj);
-        return (PyObject *)node_obj;
+
+        if (!failed && adds != NULL && adds != Py_None) {
+                if ((iter = PyObject_GetIter(adds)) == NULL) {
+                        failed = 1;
+                        iter = NULL;
+                }
+                while (iter != NULL &&
+                    (item = PyIter_Next(iter)) != NULL) {
+                        data = NULL;
+                        if (PyTuple_Check(item)) {
+                                if (PyTuple_GET_SIZE(item) != 2) {
+                                        PyErr_SetString(PyExc_ValueError,
+                                            "add entry must be a "
+                                            "(prefix, data) tuple");
+                                        Py_DECREF(item);
+                                        failed = 1;
+                                        break;
+                                }
+                                data = PyTuple_GET_ITEM(item, 1);
+                                if (parse_prefix_item(
+                                    PyTuple_GET_ITEM(item, 0),
+                                    &prefix_buf) == -1) {
+                                        Py_DECREF(item);
+                                        failed = 1;
+                                        break;
+                                }
+                        } else if (parse_prefix_item(item,
+                            &prefix_buf) == -1) {
+                                Py_DECREF(item);
+                                failed = 1;
+                                break;
+                        }
+                        if ((node = radix_lookup(self->rt,
+                            &prefix_buf)) == NULL) {
+                                PyErr_SetString(PyExc_MemoryError,
+                                    "Couldn't add prefix");
+                                Py_DECREF(item);
+                                failed = 1;
+                                break;
+                        }
+                        if (node->data == NULL) {
+                                if ((node_obj =
+                                    newRadixNodeObject(node,
+                    self->value_mode)) == NULL) {
+                                        Py_DECREF(item);
+                                        failed = 1;
+                                        break;
+                                }
+                                node->data = node_obj;
+                        } else
+                                node_obj = node->data;
+                        if (data != NULL && data != Py_None) {
+                                if (self->value_mode) {
+                                        Py_INCREF(data);
+                                        Py_XDECREF(node_obj->user_attr);
+                                        node_obj->user_attr = data;
+                                } else {
+                                        dict = RadixNode_data(node_obj,
+                                            NULL);
+                                        if (dict == NULL ||
+                                            PyDict_Update(dict,
+                                            data) == -1) {
+                                                Py_XDECREF(dict);
+                                                Py_DECREF(item);
+                                                failed = 1;
+                                                break;
+                                        }
+                                        Py_DECREF(dict);
+                                }
+                        }
+                        Py_DECREF(item);
+                }
+                Py_XDECREF(iter);
+        }
+
+        self->gen_id++;
+        if (failed || PyErr_Occurred())
+                return NULL;
+        Py_RETURN_NONE;
 }
 
-PyDoc_STRVAR(Radix_search_best_doc,
-"Radix.search_best(network[, masklen][, packed] -> None\n\
-\n\
-Search for the specified network in the radix tree.\n\
+/*
+ * Parse one text line and insert the prefix found in the requested
+ * column. Lines are split on 'delim' exactly (empty fields count, as
+ * with str.split). Returns 1 on insert, 0 for blank/comment lines,
+ * -1 on a parse error (errmsg set), -2 on allocation failure. The
+ * line may be modified in place (a NUL is poked in and restored to
+ * terminate the token), so the caller must own the buffer.
+ */
+static int
+load_text_line(radix_tree_t *rt, char *line, size_t len, long column,
+    char delim, const char **errmsg)
+{
+        prefix_t prefix_buf;
+        char *tok, *tend, *end, saved;
+        long col;
+
+        if (len > 0 && line[len - 1] == '\r')
+                len--;
+        if (len == 0 || line[0] == '#')
+                return (0);
+        tok = line;
+        end = line + len;
+        for (col = 0; col < column; col++) {
+                tok = memchr(tok, delim, end - tok);
+                if (tok == NULL) {
+                        *errmsg = "missing column";
+                        return (-1);
+                }
+                tok++;
+        }
+        tend = memchr(tok, delim, end - tok);
+        if (tend == NULL)
+                tend = end;
+        if (tend == tok) {
+                *errmsg = "empty field";
+                return (-1);
+        }
+        saved = *tend;
+        *tend = '\0';
+        if (prefix_pton_ex(&prefix_buf, tok, -1, errmsg) == NULL) {
+                *tend = saved;
+                return (-1);
+        }
+        *tend = saved;
+        if (radix_lookup(rt, &prefix_buf) == NULL)
+                return (-2);
+        return (1);
+}
+
+PyDoc_STRVAR(Radix_load_text_doc,
+"Radix.load_text(path, column=0, delimiter=' ') -> number of prefixes added\n\
 \n\
-search_best will return the best (longest) entry that includes the\n\
-specified 'prefix', much like a IP routing table lookup.\n\
+Populates the tree from a text file with one prefix per line, such\n\
+as a RIB dump. 'path' may be a filename or an open file descriptor.\n\
+Each line is split on 'delimiter' (a single character) and the field\n\
+at index 'column' is parsed as a CIDR prefix or bare address; blank\n\
+lines and lines starting with '#' are skipped. The file is scanned\n\
+and parsed entirely in C with no per-line Python objects, so loading\n\
+a large dump costs a fraction of a Python read/add loop. Raises\n\
+ValueError naming the offending line number if a line cannot be\n\
+parsed; lines before it stay inserted.\n\
 \n\
-If no match is found, then returns None.");
+Returns the number of prefixes inserted.");
 
 static PyObject *
-Radix_search_best(RadixObject *self, PyObject *args, PyObject *kw_args)
+Radix_load_text(RadixObject *self, PyObject *args, PyObject *kw_args)
 {
-        radix_node_t *node;
+        static char *keywords[] = { "path", "column", "delimiter", NULL };
+        PyObject *path_obj;
         RadixNodeObject *node_obj;
-        prefix_t lprefix, *prefix;
-        static char *keywords[] = { "network", "masklen", "packed", NULL };
+        radix_node_t *node;
+        FILE *fp;
+        char *buf, *nbuf, *line, *eol, *delim = " ";
+        const char *errmsg = NULL;
+        size_t cap, have, nread;
+        unsigned long lineno = 0, n = 0;
+        long column = 0;
+        int r, failed = 0;
+
+        if (check_writable(self) == -1)
+                return NULL;
+        if (!PyArg_ParseTupleAndKeywords(args, kw_args, "O|ls:load_text",
+            keywords, &path_obj, &column, &delim))
+                return NULL;
+        if (column < 0) {
+                PyErr_SetString(PyExc_ValueError, "column must be >= 0");
+                return NULL;
+        }
+        if (strlen(delim) != 1) {
+                PyErr_SetString(PyExc_ValueError,
+                    "delimiter must be a single character");
+                return NULL;
+        }
+        if (PyLong_Check(path_obj)) {
+                long fd = PyLong_AsLong(path_obj);
 
-        char *addr = NULL, *packed = NULL;
-        long prefixlen = -1;
-        Py_ssize_t packlen = -1;
+                if (fd == -1 && PyErr_Occurred())
+                        return NULL;
+#if defined(_MSC_VER)
+                fd = _dup((int)fd);
+                fp = (fd == -1) ? NULL : _fdopen((int)fd, "r");
+#else
+                fd = dup((int)fd);
+                fp = (fd == -1) ? NULL : fdopen((int)fd, "r");
+#endif
+        } else if (PyUnicode_Check(path_obj)) {
+                const char *path = PyUnicode_AsUTF8(path_obj);
 
-        if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|zlz#:search_best", keywords,
-            &addr, &prefixlen, &packed, &packlen))
-                return NULL;
-        if ((prefix = args_to_prefix(&lprefix, addr, packed, packlen, prefixlen)) == NULL)
+                if (path == NULL)
+                        return NULL;
+                fp = fopen(path, "r");
+        } else {
+                PyErr_SetString(PyExc_TypeError,
+                    "path must be a filename or file descriptor");
                 return NULL;
+        }
+        if (fp == NULL)
+                return PyErr_SetFromErrno(PyExc_OSError);
 
-        if ((node = radix_search_best(self->rt, prefix)) == NULL || 
-            node->data == NULL) {
-                Py_INCREF(Py_None);
-                return Py_None;
+        cap = 1 << 16;
+        if ((buf = PyMem_Malloc(cap)) == NULL) {
+                fclose(fp);
+                return PyErr_NoMemory();
         }
-        node_obj = node->data;
-        Py_XINCREF(node_obj);
-        return (PyObject *)node_obj;
-}
 
-PyDoc_STRVAR(Radix_search_worst_doc,
-"Radix.search_worst(network[, masklen][, packed] -> None\n\
-\n\
-Search for the specified network in the radix tree.\n\
+        /*
+         * Stream the file through a fixed buffer: refill, consume every
+         * complete line, slide the partial tail to the front. The buffer
+         * only grows if a single line exceeds it. One spare byte is kept
+         * so load_text_line() can always NUL-terminate its token.
+         */
+        have = 0;
+        for (;;) {
+                if (have + 1 >= cap) {
+                        if ((nbuf = PyMem_Realloc(buf, cap * 2)) == NULL) {
+                                failed = -2;
+                                break;
+                        }
+                        buf = nbuf;
+                        cap *= 2;
+                }
+                Py_BEGIN_ALLOW_THREADS
+                nread = fread(buf + have, 1, cap - have - 1, fp);
+                Py_END_ALLOW_THREADS
+                if (nread == 0)
+                        break;
+                have += nread;
+                line = buf;
+                while ((eol = memchr(line, '\n',
+                    have - (line - buf))) != NULL) {
+                        lineno++;
+                        r = load_text_line(self->rt, line, eol - line,
+                            column, *delim, &errmsg);
+                        if (r == 1)
+                                n++;
+                        else if (r < 0) {
+                                failed = r;
+                                break;
+                        }
+                        line = eol + 1;
+                }
+                if (failed)
+                        break;
+                have -= line - buf;
+                memmove(buf, line, have);
+        }
+        if (failed == 0 && ferror(fp)) {
+                PyErr_SetFromErrno(PyExc_OSError);
+                failed = -3;
+        }
+        if (failed == 0 && have > 0) {
+                /* Final line without a trailing newline */
+                lineno++;
+                r = load_text_line(self->rt, buf, have, column, *delim,
+                    &errmsg);
+                if (r == 1)
+                        n++;
+                else if (r < 0)
+                        failed = r;
+        }
+        PyMem_Free(buf);
+        fclose(fp);
+
+        /*
+         * Node objects were deferred during the scan; attach them in one
+         * pass. This runs even on failure so prefixes inserted before a
+         * bad line stay visible, matching update()'s partial-apply rule.
+         */
+        RADIX_TREE_WALK(self->rt, node) {
+                if (node->data == NULL) {
+                        if ((node_obj = newRadixNodeObject(node,
+                    self->value_mode)) == NULL)
+                                break;
+                        node->data = node_obj;
+                }
+        } RADIX_TREE_WALK_END;
+
+        self->gen_id++;
+        if (failed == -1)
+                PyErr_Format(PyExc_ValueError, "line %lu: %s", lineno,
+                    errmsg != NULL ? errmsg : "Invalid prefix");
+        else if (failed == -2)
+                PyErr_NoMemory();
+        if (PyErr_Occurred())
+                return NULL;
+        return PyInt_FromLong((long)n);
+}
+
+#define RADIX_BUILD_MAXTHREADS  64
+
+typedef struct _build_job_t {
+        radix_tree_t *rt;       /* worker-private tree */
+        prefix_t *prefixes;     /* shared parsed input, read-only */
+        const int *owner;       /* owning worker id per prefix */
+        Py_ssize_t n;
+        int id;
+        int failed;
+        PyThread_type_lock done;
+} build_job_t;
+
+/* runs without the GIL: touches only the worker's private tree */
+static void
+build_worker(void *arg)
+{
+        build_job_t *job = arg;
+        Py_ssize_t i;
+
+        for (i = 0; i < job->n; i++) {
+                if (job->owner[i] == job->id &&
+                    radix_lookup(job->rt, &job->prefixes[i]) == NULL) {
+                        job->failed = 1;
+                        break;
+                }
+        }
+        PyThread_release_lock(job->done);
+}
+
+PyDoc_STRVAR(Radix_build_doc,
+"Radix.build(prefixes, threads=4) -> number of prefixes added\n\
 \n\
-search_worst will return the worst (shortest) entry that includes the\n\
-specified 'prefix', much like opposite of a IP routing table lookup.\n\
+Bulk-populates this (empty) tree from an iterable of prefixes using\n\
+'threads' worker threads. The input is parsed once, partitioned by\n\
+its top address byte, built into independent subtries with the GIL\n\
+released, and the subtries are grafted under the root without\n\
+copying a node, so wall-clock build time scales with the thread\n\
+count. Items may be CIDR strings or packed binary addresses, as\n\
+with Radix.add_many(); prefixes shorter than 8 bits are inserted\n\
+serially after the merge.\n\
+\n\
+Returns the number of prefixes processed.");
+
+static PyObject *
+Radix_build(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+        static char *keywords[] = { "prefixes", "threads", NULL };
+        PyObject *prefixes, *iter, *item;
+        build_job_t jobs[RADIX_BUILD_MAXTHREADS];
+        radix_tree_t *trees[RADIX_BUILD_MAXTHREADS];
+        RadixNodeObject *node_obj;
+        radix_node_t *node;
+        prefix_t *parr = NULL, *npa;
+        int *owner = NULL, *noa;
+        Py_ssize_t n = 0, cap = 0, i;
+        long threads = 4;
+        int nthreads, t, failed = 0;
+
+        if (check_writable(self) == -1)
+                return NULL;
+        if (!PyArg_ParseTupleAndKeywords(args, kw_args, "O|l:build",
+            keywords, &prefixes, &threads))
+                return NULL;
+        if (threads < 1 || threads > RADIX_BUILD_MAXTHREADS) {
+                PyErr_Format(PyExc_ValueError,
+                    "threads must be between 1 and %d",
+                    RADIX_BUILD_MAXTHREADS);
+                return NULL;
+        }
+        if (self->rt->num_active_node != 0) {
+                PyErr_SetString(PyExc_ValueError,
+                    "build requires an empty tree");
+                return NULL;
+        }
+        if ((iter = PyObject_GetIter(prefixes)) == NULL)
+                return NULL;
+
+        /* parse the whole input into a flat array up front */
+        while ((item = PyIter_Next(iter)) != NULL) {
+                if (n == cap) {
+                        cap = cap ? cap * 2 : 4096;
+                        npa = PyMem_Realloc(parr, cap * sizeof(*parr));
+                        if (npa != NULL)
+                                parr = npa;
+                        noa = PyMem_Realloc(owner, cap * sizeof(*owner));
+                        if (noa != NULL)
+                                owner = noa;
+                        if (npa == NULL || noa == NULL) {
+                                PyErr_NoMemory();
+                                Py_DECREF(item);
+                                break;
+                        }
+                }
+                if (parse_prefix_item(item, &parr[n]) == -1) {
+                        Py_DECREF(item);
+                        break;
+                }
+                Py_DECREF(item);
+                n++;
+        }
+        Py_DECREF(iter);
+        if (PyErr_Occurred())
+                goto out;
+
+        nthreads = (int)threads;
+        if (nthreads == 1 || n == 0) {
+                for (i = 0; i < n; i++) {
+                        if (radix_lookup(self->rt, &parr[i]) == NULL) {
+                                PyErr_NoMemory();
+                                goto out;
+                        }
+                }
+                goto attach;
+        }
+
+        /* short prefixes span partitions; insert them serially below */
+        for (i = 0; i < n; i++)
+                owner[i] = (parr[i].bitlen >= RADIX_GRAFT_BITS) ?
+                    ((u_char *)&parr[i].add)[0] % nthreads : -1;
+
+        memset(jobs, '\0', sizeof(jobs));
+        for (t = 0; t < nthreads; t++) {
+                if ((trees[t] = New_Radix()) == NULL ||
+                    (jobs[t].done = PyThread_allocate_lock()) == NULL) {
+                        while (t >= 0) {
+                                if (trees[t] != NULL)
+                                        Destroy_Radix(trees[t], NULL, NULL);
+                                if (jobs[t].done != NULL)
+                                        PyThread_free_lock(jobs[t].done);
+                                t--;
+                        }
+                        PyErr_NoMemory();
+                        goto out;
+                }
+                jobs[t].rt = trees[t];
+                jobs[t].prefixes = parr;
+                jobs[t].owner = owner;
+                jobs[t].n = n;
+                jobs[t].id = t;
+                PyThread_acquire_lock(jobs[t].done, 1);
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        for (t = 1; t < nthreads; t++) {
+                /* on thread-spawn failure, just run the job inline */
+                if (PyThread_start_new_thread(build_worker,
+                    &jobs[t]) == PYTHREAD_INVALID_THREAD_ID)
+                        build_worker(&jobs[t]);
+        }
+        build_worker(&jobs[0]);
+        for (t = 0; t < nthreads; t++) {
+                PyThread_acquire_lock(jobs[t].done, 1);
+                PyThread_release_lock(jobs[t].done);
+        }
+        for (t = 0; t < nthreads; t++)
+                failed |= jobs[t].failed;
+        Py_END_ALLOW_THREADS
+
+        /*
+         * Only the workers' private trees may be touched without the
+         * GIL; another thread could be searching self->rt through a
+         * plain GIL-holding call.  The merge and the few short-prefix
+         * inserts are cheap, so do them here with the GIL held.
+         */
+        if (!failed && radix_graft_merge(self->rt, trees, nthreads) == -1)
+                failed = 1;
+        if (!failed) {
+                for (i = 0; i < n; i++) {
+                        if (owner[i] == -1 &&
+                            radix_lookup(self->rt, &parr[i]) == NULL) {
+                                failed = 1;
+                                break;
+                        }
+                }
+        }
+
+        for (t = 0; t < nthreads; t++) {
+                if (trees[t] != NULL)   /* not consumed by the merge */
+                        Destroy_Radix(trees[t], NULL, NULL);
+                PyThread_free_lock(jobs[t].done);
+        }
+        if (failed) {
+                /* drop any half-merged state; no node objects exist yet */
+                Clear_Radix(self->rt, NULL, NULL);
+                PyErr_NoMemory();
+                goto out;
+        }
+
+ attach:
+        RADIX_TREE_WALK(self->rt, node) {
+                if (node->data == NULL) {
+                        if ((node_obj = newRadixNodeObject(node,
+                            self->value_mode)) == NULL)
+                                break;
+                        node->data = node_obj;
+                }
+        } RADIX_TREE_WALK_END;
+        self->gen_id++;
+
+ out:
+        PyMem_Free(parr);
+        PyMem_Free(owner);
+        if (PyErr_Occurred())
+                return NULL;
+        return PyInt_FromLong((long)n);
+}
+
+#define RADIX_REAP_CHUNK        4096
+
+/*
+ * Deferred teardown: a detached tree is walked on a background
+ * thread, dropping its node-object references in bounded slices (the
+ * GIL is yielded every RADIX_REAP_CHUNK nodes) and then freeing the
+ * slabs with no GIL at all, so dropping a million-prefix table never
+ * stalls the threads serving the replacement.
+ */
+static void
+reap_worker(void *arg)
+{
+        radix_tree_t *rt = arg;
+        radix_node_t *stack[RADIX_MAXBITS + 1], **sp, *rn, *heads[2];
+        RadixNodeObject *node_obj;
+        PyGILState_STATE gil;
+        unsigned i, n = 0;
+
+        heads[0] = rt->head_ipv4;
+        heads[1] = rt->head_ipv6;
+        gil = PyGILState_Ensure();
+        for (i = 0; i < 2; i++) {
+                sp = stack;
+                rn = heads[i];
+                while (rn != NULL) {
+                        if (rn->data != NULL) {
+                                node_obj = rn->data;
+                                node_obj->rn = NULL;
+                                rn->data = NULL;
+                                Py_DECREF(node_obj);
+                                if (++n >= RADIX_REAP_CHUNK) {
+                                        n = 0;
+                                        PyGILState_Release(gil);
+                                        gil = PyGILState_Ensure();
+                                }
+                        }
+                        if (rn->l != NULL) {
+                                if (rn->r != NULL)
+                                        *sp++ = rn->r;
+                                rn = rn->l;
+                        } else if (rn->r != NULL) {
+                                rn = rn->r;
+                        } else if (sp != stack) {
+                                rn = *(--sp);
+                        } else
+                                rn = NULL;
+                }
+        }
+        PyGILState_Release(gil);
+        Destroy_Radix(rt, NULL, NULL);
+}
+
+PyDoc_STRVAR(Radix_clear_doc,
+"Radix.clear(defer=False) -> None\n\
+\n\
+Removes every prefix from the tree, which is immediately empty and\n\
+reusable. With defer=True the old nodes are detached in constant\n\
+time and torn down on a background thread in bounded slices, so\n\
+swapping out a large table pauses the caller for microseconds\n\
+instead of a full-tree walk. Node objects from the cleared table\n\
+remain valid but detached, as after delete(). Unlike other\n\
+modifications, clearing is permitted on a frozen tree (the frozen\n\
+state is discarded with the contents).");
+
+static PyObject *
+Radix_clear(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+        static char *keywords[] = { "defer", NULL };
+        radix_tree_t *old, *fresh;
+        radix_node_t *rn;
+        RadixNodeObject *node_obj;
+        int defer = 0;
+
+        if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|i:clear",
+            keywords, &defer))
+                return NULL;
+        if (self->readers != 0) {
+                PyErr_SetString(PyExc_RuntimeError,
+                    "Radix tree is busy: batch readers are active in "
+                    "other threads");
+                return NULL;
+        }
+        if (defer) {
+                if ((fresh = New_Radix()) == NULL)
+                        return PyErr_NoMemory();
+                old = self->rt;
+                self->rt = fresh;
+                /* without a spare thread, reap inline on this one */
+                if (PyThread_start_new_thread(reap_worker, old) ==
+                    PYTHREAD_INVALID_THREAD_ID)
+                        reap_worker(old);
+        } else {
+                RADIX_TREE_WALK(self->rt, rn) {
+                        if (rn->data != NULL) {
+                                node_obj = rn->data;
+                                node_obj->rn = NULL;
+                                rn->data = NULL;
+                                Py_DECREF(node_obj);
+                        }
+                } RADIX_TREE_WALK_END;
+                Clear_Radix(self->rt, NULL, NULL);
+        }
+        self->frozen = 0;
+        self->gen_id++;
+        Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(Radix_delete_doc,
+"Radix.delete(network[, masklen][, packed] -> None\n\
+\n\
+Deletes the specified network from the radix tree.");
+
+static PyObject *
+Radix_delete(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+        radix_node_t *node;
+        RadixNodeObject *node_obj;
+        prefix_t lprefix, *prefix;
+        static char *keywords[] = { "network", "masklen", "packed", NULL };
+
+        char *addr = NULL, *packed = NULL;
+        long prefixlen = -1;
+        Py_ssize_t packlen = -1;
+
+        if (check_writable(self) == -1)
+                return NULL;
+        if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|zlz#:delete", keywords,
+            &addr, &prefixlen, &packed, &packlen))
+                return NULL;
+        if ((prefix = args_to_prefix(&lprefix, addr, packed, packlen, prefixlen)) == NULL)
+                return NULL;
+        if ((node = radix_search_exact(self->rt, prefix)) == NULL) {
+                PyErr_SetString(PyExc_KeyError, "no such address");
+                return NULL;
+        }
+        if (node->data != NULL) {
+                node_obj = node->data;
+                node_obj->rn = NULL;
+                Py_XDECREF(node_obj);
+        }
+
+        radix_remove(self->rt, node);
+
+        self->gen_id++;
+        Py_INCREF(Py_None);
+        return Py_None;
+}
+
+PyDoc_STRVAR(Radix_search_exact_doc,
+"Radix.search_exact(network[, masklen][, packed] -> RadixNode or None\n\
+\n\
+Search for the specified network in the radix tree. In order to\n\
+match, the 'prefix' must be specified exactly. Contrast with the\n\
+Radix.search_best method.\n\
+\n\
+If no match is found, then this method returns None.");
+
+static PyObject *
+Radix_search_exact(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+        radix_node_t *node;
+        RadixNodeObject *node_obj;
+        prefix_t lprefix, *prefix;
+        static char *keywords[] = { "network", "masklen", "packed", NULL };
+
+        char *addr = NULL, *packed = NULL;
+        long prefixlen = -1;
+        Py_ssize_t packlen = -1;
+
+        if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|zlz#:search_exact", keywords,
+            &addr, &prefixlen, &packed, &packlen))
+                return NULL;
+        if ((prefix = args_to_prefix(&lprefix, addr, packed, packlen, prefixlen)) == NULL)
+                return NULL;
+
+        node = radix_search_exact(self->rt, prefix);
+        if (node == NULL || node->data == NULL) {
+                Py_INCREF(Py_None);
+                return Py_None;
+        }
+        node_obj = node->data;
+        Py_XINCREF(node_obj);
+        return (PyObject *)node_obj;
+}
+
+PyDoc_STRVAR(Radix_search_best_doc,
+"Radix.search_best(network[, masklen][, packed] -> None\n\
+\n\
+Search for the specified network in the radix tree.\n\
+\n\
+search_best will return the best (longest) entry that includes the\n\
+specified 'prefix', much like a IP routing table lookup.\n\
 \n\
 If no match is found, then returns None.");
 
 static PyObject *
-Radix_search_worst(RadixObject *self, PyObject *args, PyObject *kw_args)
+Radix_search_best(RadixObject *self, PyObject *args, PyObject *kw_args)
 {
         radix_node_t *node;
         RadixNodeObject *node_obj;
@@ -503,13 +1519,13 @@ Radix_search_worst(RadixObject *self, PyObject *args, PyObject *kw_args)
         long prefixlen = -1;
         Py_ssize_t packlen = -1;
 
-        if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|zlz#:search_worst", keywords,
+        if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|zlz#:search_best", keywords,
             &addr, &prefixlen, &packed, &packlen))
                 return NULL;
         if ((prefix = args_to_prefix(&lprefix, addr, packed, packlen, prefixlen)) == NULL)
                 return NULL;
 
-        if ((node = radix_search_worst(self->rt, prefix)) == NULL || 
+        if ((node = cached_search_best(self, prefix)) == NULL ||
             node->data == NULL) {
                 Py_INCREF(Py_None);
                 return Py_None;
@@ -519,155 +1535,1456 @@ Radix_search_worst(RadixObject *self, PyObject *args, PyObject *kw_args)
         return (PyObject *)node_obj;
 }
 
+/*
+ * Validate a (packed[, prefixlen]) fastcall argument pair and fill a
+ * caller-provided prefix_t, with no heap allocation or keyword parsing.
+ */
 static int
-add_node_to_list(radix_node_t *node, void *arg)
+packed_args_to_prefix(prefix_t *prefix, const char *name,
+    PyObject *const *args, Py_ssize_t nargs)
 {
-        PyObject *ret = arg;
+        long prefixlen = -1;
 
-        if (node->data != NULL)
-                PyList_Append(ret, ((PyObject *)node->data));
-        return (0);
+        if (nargs < 1 || nargs > 2) {
+                PyErr_Format(PyExc_TypeError,
+                    "%s() takes 1 or 2 positional arguments", name);
+                return -1;
+        }
+        if (!PyBytes_Check(args[0])) {
+                PyErr_Format(PyExc_TypeError,
+                    "%s() argument 1 must be packed bytes", name);
+                return -1;
+        }
+        if (nargs == 2) {
+                prefixlen = PyLong_AsLong(args[1]);
+                if (prefixlen == -1 && PyErr_Occurred())
+                        return -1;
+        }
+        if (prefix_from_blob_ex(prefix, (u_char *)PyBytes_AS_STRING(args[0]),
+            PyBytes_GET_SIZE(args[0]), prefixlen) == NULL) {
+                PyErr_SetString(PyExc_ValueError,
+                    "Invalid packed address format");
+                return -1;
+        }
+        return 0;
+}
+
+PyDoc_STRVAR(Radix_search_best_packed_doc,
+"Radix.search_best_packed(packed[, prefixlen]) -> RadixNode or None\n\
+\n\
+Fast path for Radix.search_best: 'packed' must be a 4 or 16 byte\n\
+packed binary address and 'prefixlen' an optional mask length. The\n\
+lookup runs against the caller's bytes through a stack-local prefix\n\
+with no allocation or keyword parsing.");
+
+static PyObject *
+Radix_search_best_packed(RadixObject *self, PyObject *const *args,
+    Py_ssize_t nargs)
+{
+        radix_node_t *node;
+        prefix_t prefix;
+        PyObject *node_obj;
+
+        if (packed_args_to_prefix(&prefix, "search_best_packed",
+            args, nargs) == -1)
+                return NULL;
+
+        if ((node = cached_search_best(self, &prefix)) == NULL ||
+            node->data == NULL)
+                Py_RETURN_NONE;
+        node_obj = node->data;
+        Py_INCREF(node_obj);
+        return node_obj;
+}
+
+PyDoc_STRVAR(Radix_search_exact_packed_doc,
+"Radix.search_exact_packed(packed[, prefixlen]) -> RadixNode or None\n\
+\n\
+Fast path for Radix.search_exact: 'packed' must be a 4 or 16 byte\n\
+packed binary address and 'prefixlen' an optional mask length. The\n\
+lookup runs against the caller's bytes through a stack-local prefix\n\
+with no allocation or keyword parsing.");
+
+static PyObject *
+Radix_search_exact_packed(RadixObject *self, PyObject *const *args,
+    Py_ssize_t nargs)
+{
+        radix_node_t *node;
+        prefix_t prefix;
+        PyObject *node_obj;
+
+        if (packed_args_to_prefix(&prefix, "search_exact_packed",
+            args, nargs) == -1)
+                return NULL;
+
+        if ((node = radix_search_exact(self->rt, &prefix)) == NULL ||
+            node->data == NULL)
+                Py_RETURN_NONE;
+        node_obj = node->data;
+        Py_INCREF(node_obj);
+        return node_obj;
+}
+
+PyDoc_STRVAR(Radix_search_best_many_doc,
+"Radix.search_best_many(addresses) -> list of RadixNode or None\n\
+\n\
+Performs a best-match search for every address in 'addresses' and\n\
+returns the results as a list, with None for addresses that did not\n\
+match. Each item may be a string in CIDR format or a packed binary\n\
+address (4 or 16 bytes).\n\
+\n\
+The tree walks for the whole batch run in a tight C loop with the\n\
+GIL released, so other threads can make progress while a large batch\n\
+is resolved.");
+
+static PyObject *
+Radix_search_best_many(RadixObject *self, PyObject *args)
+{
+        PyObject *addresses, *fast, *item, *ret, *entry;
+        prefix_t *prefixes;
+        radix_node_t **found;
+        Py_ssize_t i, n;
+
+        if (!PyArg_ParseTuple(args, "O:search_best_many", &addresses))
+                return NULL;
+        if ((fast = PySequence_Fast(addresses,
+            "addresses must be a sequence")) == NULL)
+                return NULL;
+        n = PySequence_Fast_GET_SIZE(fast);
+
+        prefixes = PyMem_Malloc(n * sizeof(*prefixes));
+        found = PyMem_Malloc(n * sizeof(*found));
+        if ((prefixes == NULL || found == NULL) && n > 0) {
+                PyErr_NoMemory();
+                goto err;
+        }
+
+        /* Parse everything up front, then walk the trie without the GIL */
+        for (i = 0; i < n; i++) {
+                item = PySequence_Fast_GET_ITEM(fast, i);
+                if (parse_prefix_item(item, &prefixes[i]) == -1)
+                        goto err;
+        }
+
+        /*
+         * Account for ourselves as a reader before dropping the GIL so
+         * writers in other threads refuse to mutate the trie under us.
+         */
+        self->readers++;
+        Py_BEGIN_ALLOW_THREADS
+        for (i = 0; i < n; i++)
+                found[i] = radix_search_best2(self->rt, &prefixes[i], 1);
+        Py_END_ALLOW_THREADS
+        self->readers--;
+
+        if ((ret = PyList_New(n)) == NULL)
+                goto err;
+        for (i = 0; i < n; i++) {
+                if (found[i] == NULL || found[i]->data == NULL)
+                        entry = Py_None;
+                else
+                        entry = (PyObject *)found[i]->data;
+                Py_INCREF(entry);
+                PyList_SET_ITEM(ret, i, entry);
+        }
+
+        PyMem_Free(prefixes);
+        PyMem_Free(found);
+        Py_DECREF(fast);
+        return (ret);
+
+err:
+        PyMem_Free(prefixes);
+        PyMem_Free(found);
+        Py_DECREF(fast);
+        return NULL;
+}
+
+PyDoc_STRVAR(Radix_search_worst_doc,
+"Radix.search_worst(network[, masklen][, packed] -> None\n\
+\n\
+Search for the specified network in the radix tree.\n\
+\n\
+search_worst will return the worst (shortest) entry that includes the\n\
+specified 'prefix', much like opposite of a IP routing table lookup.\n\
+\n\
+If no match is found, then returns None.");
+
+static PyObject *
+Radix_search_worst(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+        radix_node_t *node;
+        RadixNodeObject *node_obj;
+        prefix_t lprefix, *prefix;
+        static char *keywords[] = { "network", "masklen", "packed", NULL };
+
+        char *addr = NULL, *packed = NULL;
+        long prefixlen = -1;
+        Py_ssize_t packlen = -1;
+
+        if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|zlz#:search_worst", keywords,
+            &addr, &prefixlen, &packed, &packlen))
+                return NULL;
+        if ((prefix = args_to_prefix(&lprefix, addr, packed, packlen, prefixlen)) == NULL)
+                return NULL;
+
+        if ((node = radix_search_worst(self->rt, prefix)) == NULL || 
+            node->data == NULL) {
+                Py_INCREF(Py_None);
+                return Py_None;
+        }
+        node_obj = node->data;
+        Py_XINCREF(node_obj);
+        return (PyObject *)node_obj;
+}
+
+static int
+add_node_to_list(radix_node_t *node, void *arg)
+{
+        PyObject *ret = arg;
+
+        if (node->data != NULL)
+                PyList_Append(ret, ((PyObject *)node->data));
+        return (0);
+}
+
+PyDoc_STRVAR(Radix_search_covered_doc,
+"Radix.search_covered(network[, masklen][, packed][, form]) -> list or int\n\
+\n\
+Returns the nodes with a more specific or equal prefix, i.e. those\n\
+contained within the given network. 'form' selects the result type:\n\
+'nodes' (the default) returns RadixNode objects, 'prefixes' returns\n\
+the prefixes as CIDR strings, and 'count' returns just the number\n\
+of covered prefixes; the latter two never materialize node objects.");
+
+static PyObject *
+Radix_search_covered(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+        prefix_t lprefix, *prefix;
+        radix_node_t *start, *node;
+        RadixNodeObject *node_obj;
+        PyObject *ret, *item;
+        Py_ssize_t n, i;
+        char buf[256];
+
+        static char *keywords[] = { "network", "masklen", "packed", "form", NULL };
+
+        char *addr = NULL, *packed = NULL;
+        const char *form = "nodes";
+        long prefixlen = -1;
+        Py_ssize_t packlen = -1;
+
+        if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|zlz#s:search_covered", keywords, &addr, &prefixlen, &packed, &packlen, &form))
+                return NULL;
+        if (strcmp(form, "nodes") != 0 && strcmp(form, "prefixes") != 0 &&
+            strcmp(form, "count") != 0) {
+                PyErr_SetString(PyExc_ValueError,
+                    "form must be 'nodes', 'prefixes' or 'count'");
+                return NULL;
+        }
+
+        if ((prefix = args_to_prefix(&lprefix, addr, packed, packlen, prefixlen)) == NULL)
+                return NULL;
+
+        /*
+         * Two phases: a C-only counting pass over the covered subtree,
+         * then a presized result list filled with PyList_SET_ITEM, so
+         * no PyList_Append reallocation churn on large scans.
+         */
+        start = radix_subtree(self->rt, prefix);
+        n = 0;
+        if (start != NULL) {
+                RADIX_WALK(start, node) {
+                        if (prefix_covered(node->prefix, prefix))
+                                n++;
+                } RADIX_WALK_END;
+        }
+        if (strcmp(form, "count") == 0)
+                return PyLong_FromSsize_t(n);
+
+        if ((ret = PyList_New(n)) == NULL)
+                return NULL;
+        i = 0;
+        if (start != NULL) {
+                RADIX_WALK(start, node) {
+                        if (prefix_covered(node->prefix, prefix)) {
+                                if (form[0] == 'p') {
+                                        if (prefix_ntop(node->prefix, buf,
+                                            sizeof(buf)) == NULL ||
+                                            (item = PyUnicode_FromString(
+                                            buf)) == NULL) {
+                                                Py_DECREF(ret);
+                                                return NULL;
+                                        }
+                                } else {
+                                        if (node->data == NULL) {
+                                                if ((node_obj =
+                                                    newRadixNodeObject(node,
+                                                    self->value_mode)) == NULL) {
+                                                        Py_DECREF(ret);
+                                                        return NULL;
+                                                }
+                                                node->data = node_obj;
+                                        }
+                                        item = (PyObject *)node->data;
+                                        Py_INCREF(item);
+                                }
+                                PyList_SET_ITEM(ret, i, item);
+                                i++;
+                        }
+                } RADIX_WALK_END;
+        }
+        return (ret);
+}
+
+PyDoc_STRVAR(Radix_search_covering_doc,
+"Radix.search_covering(network[, masklen][, packed] -> List of RadixNode\n\
+\n\
+Returns a list of nodes with a less specific or same prefix than network.\n\
+\n\
+If no match is found, then returns an empty list.");
+
+static PyObject *
+Radix_search_covering(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+        prefix_t lprefix, *prefix;
+        PyObject *ret;
+
+        static char *keywords[] = { "network", "masklen", "packed", NULL };
+
+        char *addr = NULL, *packed = NULL;
+        long prefixlen = -1;
+        Py_ssize_t packlen = -1;
+
+        if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|zlz#:search_covering", keywords, &addr, &prefixlen, &packed, &packlen)) {
+                return NULL;
+        }
+
+        if ((prefix = args_to_prefix(&lprefix, addr, packed, packlen, prefixlen)) == NULL) {
+                return NULL;
+        }
+
+        if ((ret = PyList_New(0)) == NULL) {
+                return NULL;
+        }
+
+        radix_search_covering(self->rt, prefix, add_node_to_list, ret);
+
+        return ret;
+}
+
+/*
+ * Prefix aggregation. The walk is preorder, so prefixes arrive sorted
+ * with covering prefixes first; a small stack of pending prefixes is
+ * enough to drop entries covered by an equal-keyed ancestor and to
+ * merge buddy pairs into their parent in one pass.
+ */
+
+struct agg_ent {
+        u_char addr[16];
+        u_int bitlen;
+        PyObject *key;          /* NULL when no key function is given */
+};
+
+/* nested ancestors plus one pending left half per level */
+#define AGG_STACK_MAX (2 * (RADIX_MAXBITS + 1))
+
+static int
+agg_bit_set(const u_char *addr, u_int bit)
+{
+        return (addr[bit >> 3] & (0x80 >> (bit & 0x07))) != 0;
+}
+
+static int
+agg_match(const u_char *a, const u_char *b, u_int bits)
+{
+        u_int n = bits / 8;
+
+        if (memcmp(a, b, n) != 0)
+                return 0;
+        if (bits % 8 == 0)
+                return 1;
+        return ((a[n] ^ b[n]) & (0xff << (8 - bits % 8))) == 0;
+}
+
+static int
+agg_key_eq(PyObject *a, PyObject *b)
+{
+        if (a == NULL || b == NULL)
+                return (a == b);
+        return PyObject_RichCompareBool(a, b, Py_EQ);
+}
+
+/* insert a prefix with a fresh node object into a result tree */
+static int
+radix_obj_insert(RadixObject *dst, prefix_t *pfx)
+{
+        radix_node_t *node;
+        RadixNodeObject *node_obj;
+
+        if ((node = radix_lookup(dst->rt, pfx)) == NULL) {
+                PyErr_SetString(PyExc_MemoryError, "Couldn't add prefix");
+                return -1;
+        }
+        if (node->data == NULL) {
+                if ((node_obj = newRadixNodeObject(node,
+                    dst->value_mode)) == NULL)
+                        return -1;
+                node->data = node_obj;
+        }
+        return 0;
+}
+
+static int
+agg_emit(RadixObject *agg, int family, struct agg_ent *ent)
+{
+        prefix_t pfx;
+
+        if (prefix_from_blob_ex(&pfx, ent->addr,
+            family == AF_INET ? 4 : 16, ent->bitlen) == NULL) {
+                PyErr_SetString(PyExc_SystemError, "invalid prefix");
+                return -1;
+        }
+        return radix_obj_insert(agg, &pfx);
+}
+
+static int
+agg_run(RadixObject *agg, radix_node_t *head, int family, PyObject *keyfn)
+{
+        struct agg_ent stack[AGG_STACK_MAX], *ent;
+        radix_node_t *node;
+        PyObject *key = NULL, *data;
+        u_char *addr;
+        u_int bitlen;
+        int sp = 0, i, rc, covered;
+
+        if (head == NULL)
+                return 0;
+
+        RADIX_WALK(head, node) {
+                if (node->data != NULL) {
+                        addr = (u_char *)&node->prefix->add;
+                        bitlen = node->prefix->bitlen;
+                        if (keyfn != NULL) {
+                                if (((RadixNodeObject *)
+                                    node->data)->value_mode)
+                                        data = RadixNode_value_get(
+                                            (RadixNodeObject *)node->data,
+                                            NULL);
+                                else
+                                        data = RadixNode_data(
+                                            (RadixNodeObject *)node->data,
+                                            NULL);
+                                if (data == NULL)
+                                        goto err;
+                                key = PyObject_CallFunctionObjArgs(keyfn,
+                                    data, NULL);
+                                Py_DECREF(data);
+                                if (key == NULL)
+                                        goto err;
+                        }
+
+                        /* finalize entries this prefix has moved past */
+                        while (sp > 0) {
+                                ent = &stack[sp - 1];
+                                /* still an ancestor of the new prefix? */
+                                if (ent->bitlen == 0 ||
+                                    agg_match(ent->addr, addr, ent->bitlen))
+                                        break;
+                                /* left half whose buddy may still arrive? */
+                                if (!agg_bit_set(ent->addr, ent->bitlen - 1) &&
+                                    agg_match(ent->addr, addr,
+                                    ent->bitlen - 1))
+                                        break;
+                                if (agg_emit(agg, family, ent) == -1)
+                                        goto err;
+                                Py_XDECREF(ent->key);
+                                sp--;
+                        }
+
+                        /* covered by the nearest kept ancestor? */
+                        covered = 0;
+                        for (i = sp - 1; i >= 0; i--) {
+                                if (stack[i].bitlen > bitlen ||
+                                    !agg_match(stack[i].addr, addr,
+                                    stack[i].bitlen))
+                                        continue;
+                                if ((rc = agg_key_eq(stack[i].key,
+                                    key)) == -1)
+                                        goto err;
+                                covered = rc;
+                                break;
+                        }
+                        if (covered) {
+                                Py_XDECREF(key);
+                                key = NULL;
+                        } else {
+                                if (sp >= AGG_STACK_MAX) {
+                                        PyErr_SetString(PyExc_SystemError,
+                                            "aggregation stack overflow");
+                                        goto err;
+                                }
+                                ent = &stack[sp++];
+                                memset(ent->addr, 0, sizeof(ent->addr));
+                                memcpy(ent->addr, addr, (bitlen + 7) / 8);
+                                ent->bitlen = bitlen;
+                                ent->key = key;
+                                key = NULL;
+
+                                /* merge buddy pairs into their parent */
+                                while (sp >= 2) {
+                                        struct agg_ent *a = &stack[sp - 2];
+                                        struct agg_ent *b = &stack[sp - 1];
+
+                                        if (a->bitlen == 0 ||
+                                            a->bitlen != b->bitlen)
+                                                break;
+                                        if (agg_bit_set(a->addr,
+                                            a->bitlen - 1) ||
+                                            !agg_bit_set(b->addr,
+                                            b->bitlen - 1))
+                                                break;
+                                        if (!agg_match(a->addr, b->addr,
+                                            a->bitlen - 1))
+                                                break;
+                                        if ((rc = agg_key_eq(a->key,
+                                            b->key)) == -1)
+                                                goto err;
+                                        if (!rc)
+                                                break;
+                                        Py_XDECREF(b->key);
+                                        sp--;
+                                        a->bitlen--;
+                                }
+                        }
+                }
+        } RADIX_WALK_END;
+
+        while (sp > 0) {
+                if (agg_emit(agg, family, &stack[sp - 1]) == -1)
+                        goto err;
+                Py_XDECREF(stack[sp - 1].key);
+                sp--;
+        }
+        return 0;
+ err:
+        Py_XDECREF(key);
+        while (sp > 0)
+                Py_XDECREF(stack[--sp].key);
+        return -1;
+}
+
+PyDoc_STRVAR(Radix_aggregate_doc,
+"Radix.aggregate(key=None) -> new Radix\n\
+\n\
+Returns a new tree holding the aggregated view of this one: prefixes\n\
+covered by a shorter prefix are dropped and adjacent buddy pairs are\n\
+merged into their parent, repeatedly. When 'key' is given it is\n\
+called with each node's data dict and prefixes only merge or collapse\n\
+when their keys compare equal. Node data is not carried over.");
+
+static PyObject *
+Radix_aggregate(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+        static char *keywords[] = { "key", NULL };
+        PyObject *keyfn = Py_None;
+        RadixObject *agg;
+
+        if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|O:aggregate",
+            keywords, &keyfn))
+                return NULL;
+        if (keyfn == Py_None)
+                keyfn = NULL;
+
+        if ((agg = newRadixObject()) == NULL)
+                return NULL;
+        agg->value_mode = self->value_mode;
+        if (agg_run(agg, self->rt->head_ipv4, AF_INET, keyfn) == -1 ||
+            agg_run(agg, self->rt->head_ipv6, AF_INET6, keyfn) == -1) {
+                Py_DECREF(agg);
+                return NULL;
+        }
+        return (PyObject *)agg;
+}
+
+/*
+ * Set operations between two trees. The preorder walk of a patricia
+ * trie yields prefixes in sorted order, so walking both trees with a
+ * cursor each and merge-joining the streams visits every node exactly
+ * once, with no per-prefix probes into the other tree.
+ */
+
+struct rdx_cursor {
+        radix_node_t *stack[RADIX_MAXBITS + 1];
+        radix_node_t **sp;
+        radix_node_t *rn;
+};
+
+static void
+cursor_init(struct rdx_cursor *c, radix_node_t *head)
+{
+        c->sp = c->stack;
+        c->rn = head;
+}
+
+static radix_node_t *
+cursor_next(struct rdx_cursor *c)
+{
+        radix_node_t *node;
+
+        while ((node = c->rn) != NULL) {
+                if (c->rn->l) {
+                        if (c->rn->r)
+                                *c->sp++ = c->rn->r;
+                        c->rn = c->rn->l;
+                } else if (c->rn->r)
+                        c->rn = c->rn->r;
+                else if (c->sp != c->stack)
+                        c->rn = *(--c->sp);
+                else
+                        c->rn = NULL;
+                if (node->prefix != NULL && node->data != NULL)
+                        return (node);
+        }
+        return (NULL);
+}
+
+/* walk order: first differing bit decides, then shorter prefix first */
+static int
+prefix_walk_cmp(prefix_t *a, prefix_t *b)
+{
+        u_char *pa = (u_char *)&a->add, *pb = (u_char *)&b->add;
+        u_char xa, xb, x, bitmask, m;
+        u_int min, i, n;
+
+        min = a->bitlen < b->bitlen ? a->bitlen : b->bitlen;
+        n = (min + 7) / 8;
+        for (i = 0; i < n; i++) {
+                xa = pa[i];
+                xb = pb[i];
+                if (i == n - 1 && min % 8 != 0) {
+                        m = 0xff << (8 - min % 8);
+                        xa &= m;
+                        xb &= m;
+                }
+                if (xa != xb) {
+                        x = xa ^ xb;
+                        for (bitmask = 0x80; !(x & bitmask); bitmask >>= 1)
+                                ;
+                        return ((xa & bitmask) ? 1 : -1);
+                }
+        }
+        if (a->bitlen == b->bitlen)
+                return 0;
+        return (a->bitlen < b->bitlen ? -1 : 1);
+}
+
+enum rdx_setop {
+        RDX_OP_UNION,
+        RDX_OP_INTERSECTION,
+        RDX_OP_DIFFERENCE,
+};
+
+static int
+radix_merge_join(RadixObject *res, radix_node_t *heada, radix_node_t *headb,
+    enum rdx_setop op)
+{
+        struct rdx_cursor ca, cb;
+        radix_node_t *na, *nb;
+        int cmp;
+
+        cursor_init(&ca, heada);
+        cursor_init(&cb, headb);
+        na = cursor_next(&ca);
+        nb = cursor_next(&cb);
+        while (na != NULL || nb != NULL) {
+                if (na == NULL)
+                        cmp = 1;
+                else if (nb == NULL)
+                        cmp = -1;
+                else
+                        cmp = prefix_walk_cmp(na->prefix, nb->prefix);
+                if (cmp < 0) {
+                        if (op != RDX_OP_INTERSECTION &&
+                            radix_obj_insert(res, na->prefix) == -1)
+                                return -1;
+                        na = cursor_next(&ca);
+                } else if (cmp > 0) {
+                        if (op == RDX_OP_UNION &&
+                            radix_obj_insert(res, nb->prefix) == -1)
+                                return -1;
+                        nb = cursor_next(&cb);
+                } else {
+                        if (op != RDX_OP_DIFFERENCE &&
+                            radix_obj_insert(res, na->prefix) == -1)
+                                return -1;
+                        na = cursor_next(&ca);
+                        nb = cursor_next(&cb);
+                }
+        }
+        return 0;
+}
+
+static PyObject *
+Radix_setop(RadixObject *self, PyObject *arg, enum rdx_setop op)
+{
+        RadixObject *other, *res;
+
+        if (!Radix_CheckExact(arg)) {
+                PyErr_SetString(PyExc_TypeError, "expected a Radix tree");
+                return NULL;
+        }
+        other = (RadixObject *)arg;
+
+        if ((res = newRadixObject()) == NULL)
+                return NULL;
+        res->value_mode = self->value_mode;
+        if (radix_merge_join(res, self->rt->head_ipv4,
+            other->rt->head_ipv4, op) == -1 ||
+            radix_merge_join(res, self->rt->head_ipv6,
+            other->rt->head_ipv6, op) == -1) {
+                Py_DECREF(res);
+                return NULL;
+        }
+        return (PyObject *)res;
+}
+
+PyDoc_STRVAR(Radix_union_doc,
+"Radix.union(other) -> new Radix\n\
+\n\
+Returns a new tree containing the prefixes present in either tree.\n\
+Result nodes carry fresh empty data dicts.");
+
+static PyObject *
+Radix_union(RadixObject *self, PyObject *arg)
+{
+        return Radix_setop(self, arg, RDX_OP_UNION);
+}
+
+PyDoc_STRVAR(Radix_intersection_doc,
+"Radix.intersection(other) -> new Radix\n\
+\n\
+Returns a new tree containing the prefixes present in both trees.\n\
+Result nodes carry fresh empty data dicts.");
+
+static PyObject *
+Radix_intersection(RadixObject *self, PyObject *arg)
+{
+        return Radix_setop(self, arg, RDX_OP_INTERSECTION);
+}
+
+PyDoc_STRVAR(Radix_difference_doc,
+"Radix.difference(other) -> new Radix\n\
+\n\
+Returns a new tree containing the prefixes present in this tree but\n\
+not in 'other'. Result nodes carry fresh empty data dicts.");
+
+static PyObject *
+Radix_difference(RadixObject *self, PyObject *arg)
+{
+        return Radix_setop(self, arg, RDX_OP_DIFFERENCE);
+}
+
+static int
+stats_set(PyObject *dict, const char *key, PyObject *val)
+{
+        int rc;
+
+        if (val == NULL)
+                return -1;
+        rc = PyDict_SetItemString(dict, key, val);
+        Py_DECREF(val);
+        return rc;
+}
+
+PyDoc_STRVAR(Radix_stats_doc,
+"Radix.stats() -> dict\n\
+\n\
+Returns counters and memory figures for the tree: per-family dicts\n\
+('ipv4', 'ipv6') with 'prefixes' (nodes carrying a prefix), 'glue'\n\
+(internal branch nodes) and 'depth_hist' (node count per trie depth);\n\
+'node_bytes'/'prefix_bytes' held by the slab allocators; and the\n\
+'inserts', 'deletes' and 'lookups' performed since creation.");
+
+static PyObject *
+Radix_stats(RadixObject *self, PyObject *args)
+{
+        struct {
+                radix_node_t *node;
+                int depth;
+        } stack[RADIX_MAXBITS + 3];
+        radix_node_t *heads[2], *node;
+        long hist[RADIX_MAXBITS + 2];
+        long prefixes, glue;
+        int sp, depth, maxdepth, i, fam;
+        PyObject *ret, *sub, *histlist, *v;
+        static const char *famkey[] = { "ipv4", "ipv6" };
+
+        if (!PyArg_ParseTuple(args, ":stats"))
+                return NULL;
+
+        if ((ret = PyDict_New()) == NULL)
+                return NULL;
+
+        heads[0] = self->rt->head_ipv4;
+        heads[1] = self->rt->head_ipv6;
+        for (fam = 0; fam < 2; fam++) {
+                prefixes = glue = 0;
+                maxdepth = -1;
+                memset(hist, 0, sizeof(hist));
+                sp = 0;
+                if (heads[fam] != NULL) {
+                        stack[sp].node = heads[fam];
+                        stack[sp].depth = 0;
+                        sp = 1;
+                }
+                /* node bits increase strictly, so depth <= MAXBITS+1 */
+                while (sp > 0) {
+                        sp--;
+                        node = stack[sp].node;
+                        depth = stack[sp].depth;
+                        if (node->prefix != NULL)
+                                prefixes++;
+                        else
+                                glue++;
+                        hist[depth]++;
+                        if (depth > maxdepth)
+                                maxdepth = depth;
+                        if (node->l != NULL) {
+                                stack[sp].node = node->l;
+                                stack[sp].depth = depth + 1;
+                                sp++;
+                        }
+                        if (node->r != NULL) {
+                                stack[sp].node = node->r;
+                                stack[sp].depth = depth + 1;
+                                sp++;
+                        }
+                }
+
+                if ((sub = PyDict_New()) == NULL)
+                        goto err;
+                if (PyDict_SetItemString(ret, famkey[fam], sub) == -1) {
+                        Py_DECREF(sub);
+                        goto err;
+                }
+                Py_DECREF(sub);         /* still owned by ret */
+                if (stats_set(sub, "prefixes",
+                    PyInt_FromLong(prefixes)) == -1 ||
+                    stats_set(sub, "glue", PyInt_FromLong(glue)) == -1)
+                        goto err;
+                if ((histlist = PyList_New(maxdepth + 1)) == NULL)
+                        goto err;
+                for (i = 0; i <= maxdepth; i++) {
+                        if ((v = PyInt_FromLong(hist[i])) == NULL) {
+                                Py_DECREF(histlist);
+                                goto err;
+                        }
+                        PyList_SET_ITEM(histlist, i, v);
+                }
+                if (stats_set(sub, "depth_hist", histlist) == -1)
+                        goto err;
+        }
+
+        if (stats_set(ret, "node_bytes",
+            PyLong_FromSize_t(self->rt->node_pool.allocated)) == -1 ||
+            stats_set(ret, "prefix_bytes",
+            PyLong_FromSize_t(self->rt->prefix_pool.allocated)) == -1 ||
+            stats_set(ret, "inserts",
+            PyLong_FromUnsignedLongLong(self->rt->num_inserts)) == -1 ||
+            stats_set(ret, "deletes",
+            PyLong_FromUnsignedLongLong(self->rt->num_removes)) == -1 ||
+            stats_set(ret, "lookups",
+            PyLong_FromUnsignedLongLong(self->rt->num_lookups)) == -1)
+                goto err;
+        if (self->cache != NULL &&
+            (stats_set(ret, "cache_hits",
+            PyLong_FromUnsignedLongLong(self->cache_hits)) == -1 ||
+            stats_set(ret, "cache_misses",
+            PyLong_FromUnsignedLongLong(self->cache_misses)) == -1))
+                goto err;
+
+        return ret;
+ err:
+        Py_DECREF(ret);
+        return NULL;
+}
+
+PyDoc_STRVAR(Radix_nodes_doc,
+"Radix.nodes(prefix) -> List of RadixNode\n\
+\n\
+Returns a list containing all the RadixNode objects that have been\n\
+entered into the tree. This list may be empty if no prefixes have\n\
+been entered.");
+
+static PyObject *
+Radix_nodes(RadixObject *self, PyObject *args)
+{
+        radix_node_t *node;
+        PyObject *ret;
+
+        if (!PyArg_ParseTuple(args, ":nodes"))
+                return NULL;
+
+        if ((ret = PyList_New(0)) == NULL)
+                return NULL;
+
+        RADIX_TREE_WALK(self->rt, node) {
+                if (node->data != NULL)
+                        PyList_Append(ret, (PyObject *)node->data);
+        } RADIX_TREE_WALK_END;
+
+        return (ret);
+}
+
+PyDoc_STRVAR(Radix_prefixes_doc,
+"Radix.prefixes(prefix) -> List of prefix strings\n\
+\n\
+Returns a list containing all the prefixes that have been entered\n\
+into the tree. This list may be empty if no prefixes have been\n\
+entered.");
+
+static PyObject *
+Radix_prefixes(RadixObject *self, PyObject *args)
+{
+        radix_node_t *node;
+        PyObject *ret, *prefix_obj;
+
+        if (!PyArg_ParseTuple(args, ":prefixes"))
+                return NULL;
+
+        if ((ret = PyList_New(0)) == NULL)
+                return NULL;
+
+        RADIX_TREE_WALK(self->rt, node) {
+                if (node->data != NULL) {
+                        prefix_obj = RadixNode_prefix(node->data, NULL);
+                        if (prefix_obj == NULL) {
+                                Py_DECREF(ret);
+                                return NULL;
+                        }
+                        PyList_Append(ret, prefix_obj);
+                        Py_DECREF(prefix_obj);
+                }
+        } RADIX_TREE_WALK_END;
+
+        return (ret);
+}
+
+PyDoc_STRVAR(Radix_snapshot_doc,
+"Radix.snapshot() -> bytes\n\
+\n\
+Serializes the tree structure into a flat, versioned binary blob\n\
+that Radix.load_snapshot() can restore in a single pass without\n\
+re-parsing any prefixes. User data dicts are not included.");
+
+static PyObject *
+Radix_snapshot(RadixObject *self, PyObject *args)
+{
+        PyObject *ret;
+        size_t size;
+
+        if (!PyArg_ParseTuple(args, ":snapshot"))
+                return NULL;
+
+        size = radix_snapshot_size(self->rt);
+        if ((ret = PyBytes_FromStringAndSize(NULL, size)) == NULL)
+                return NULL;
+        if (radix_snapshot_write(self->rt,
+            (u_char *)PyBytes_AS_STRING(ret), size) == -1) {
+                Py_DECREF(ret);
+                return PyErr_NoMemory();
+        }
+        return (ret);
+}
+
+static int
+attach_node_cb(radix_node_t *node, void *cbctx)
+{
+        RadixObject *tree = cbctx;
+        RadixNodeObject *node_obj;
+
+        if ((node_obj = newRadixNodeObject(node, tree->value_mode)) == NULL)
+                return (-1);
+        node->data = node_obj;
+        return (0);
+}
+
+PyDoc_STRVAR(Radix_load_snapshot_doc,
+"Radix.load_snapshot(buffer) -> None\n\
+\n\
+Restores a tree serialized by Radix.snapshot() into this (empty)\n\
+tree. 'buffer' may be any object supporting the buffer protocol,\n\
+including an mmap of a snapshot file, so a saved table can be\n\
+loaded nearly instantly without deserialization overhead.");
+
+static PyObject *
+Radix_load_snapshot(RadixObject *self, PyObject *args)
+{
+        Py_buffer view;
+        int rc;
+
+        if (!PyArg_ParseTuple(args, "y*:load_snapshot", &view))
+                return NULL;
+        if (check_writable(self) == -1) {
+                PyBuffer_Release(&view);
+                return NULL;
+        }
+        if (self->rt->num_active_node != 0) {
+                PyBuffer_Release(&view);
+                PyErr_SetString(PyExc_ValueError,
+                    "load_snapshot() requires an empty tree");
+                return NULL;
+        }
+
+        rc = radix_snapshot_load(self->rt, view.buf, view.len,
+            attach_node_cb, self);
+        PyBuffer_Release(&view);
+        if (rc == -1) {
+                PyErr_SetString(PyExc_ValueError,
+                    "invalid or corrupt snapshot");
+                return NULL;
+        }
+        if (rc == -2) {
+                if (!PyErr_Occurred())
+                        PyErr_NoMemory();
+                return NULL;
+        }
+        self->gen_id++;
+        Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(Radix_getstate_doc,
+"Radix.__getstate__() -> (bytes, list)\n\
+\n\
+Captures the tree as a compact record blob (family, prefix length\n\
+and address bytes per prefix, in walk order) plus a list of the\n\
+user data dicts in the same order. Used by pickle; much faster\n\
+than walking RadixNode objects and their attributes.");
+
+static PyObject *
+Radix_getstate(RadixObject *self, PyObject *unused)
+{
+        PyObject *blob, *data_list, *d;
+        radix_node_t *node;
+        u_char *p;
+        int alen;
+
+        /* family + bitlen header; a 16-byte address bounds every record */
+        if ((blob = PyBytes_FromStringAndSize(NULL,
+            (size_t)self->rt->num_prefixes * 18)) == NULL)
+                return NULL;
+        if ((data_list = PyList_New(0)) == NULL) {
+                Py_DECREF(blob);
+                return NULL;
+        }
+        p = (u_char *)PyBytes_AS_STRING(blob);
+        RADIX_TREE_WALK(self->rt, node) {
+                alen = (node->prefix->family == AF_INET6) ? 16 : 4;
+                *p++ = (node->prefix->family == AF_INET6) ? 6 : 4;
+                *p++ = node->prefix->bitlen;
+                memcpy(p, &node->prefix->add, alen);
+                p += alen;
+                d = (node->data != NULL) ?
+                    ((RadixNodeObject *)node->data)->user_attr : NULL;
+                if (d == NULL)
+                        d = Py_None;
+                if (PyList_Append(data_list, d) == -1) {
+                        Py_DECREF(blob);
+                        Py_DECREF(data_list);
+                        return NULL;
+                }
+        } RADIX_TREE_WALK_END;
+        if (_PyBytes_Resize(&blob,
+            p - (u_char *)PyBytes_AS_STRING(blob)) == -1) {
+                Py_DECREF(data_list);
+                return NULL;
+        }
+        return Py_BuildValue("(NN)", blob, data_list);
+}
+
+PyDoc_STRVAR(Radix_setstate_doc,
+"Radix.__setstate__(state) -> None\n\
+\n\
+Restores a tree captured by Radix.__getstate__() with a single C\n\
+loop over the record blob, bypassing per-node attribute objects.");
+
+static PyObject *
+Radix_setstate(RadixObject *self, PyObject *state)
+{
+        PyObject *blob, *data_list, *d;
+        const u_char *p, *end;
+        Py_ssize_t idx, ndata;
+        prefix_t pfx;
+        radix_node_t *node;
+        RadixNodeObject *node_obj;
+        int alen;
+
+        if (!PyTuple_Check(state) || PyTuple_GET_SIZE(state) != 2 ||
+            !PyBytes_Check(blob = PyTuple_GET_ITEM(state, 0)) ||
+            !PyList_Check(data_list = PyTuple_GET_ITEM(state, 1))) {
+                PyErr_SetString(PyExc_ValueError, "invalid pickle state");
+                return NULL;
+        }
+        if (check_writable(self) == -1)
+                return NULL;
+
+        p = (const u_char *)PyBytes_AS_STRING(blob);
+        end = p + PyBytes_GET_SIZE(blob);
+        ndata = PyList_GET_SIZE(data_list);
+        for (idx = 0; p < end; idx++) {
+                alen = (p[0] == 6) ? 16 : 4;
+                if ((p[0] != 4 && p[0] != 6) || end - p < 2 + alen ||
+                    idx >= ndata) {
+                        PyErr_SetString(PyExc_ValueError,
+                            "invalid pickle state");
+                        return NULL;
+                }
+                if (prefix_from_blob_ex(&pfx, (u_char *)p + 2, alen,
+                    p[1]) == NULL) {
+                        PyErr_SetString(PyExc_ValueError,
+                            "invalid pickle state");
+                        return NULL;
+                }
+                if ((node = radix_lookup(self->rt, &pfx)) == NULL)
+                        return PyErr_NoMemory();
+                if (node->data == NULL) {
+                        if ((node_obj = newRadixNodeObject(node,
+                    self->value_mode)) == NULL)
+                                return NULL;
+                        node->data = node_obj;
+                } else
+                        node_obj = node->data;
+                d = PyList_GET_ITEM(data_list, idx);
+                if (d != Py_None) {
+                        if (!self->value_mode && !PyDict_Check(d)) {
+                                PyErr_SetString(PyExc_ValueError,
+                                    "invalid pickle state");
+                                return NULL;
+                        }
+                        Py_INCREF(d);
+                        Py_XDECREF(node_obj->user_attr);
+                        node_obj->user_attr = d;
+                }
+                p += 2 + alen;
+        }
+        self->gen_id++;
+        Py_RETURN_NONE;
 }
 
-PyDoc_STRVAR(Radix_search_covered_doc,
-"Radix.search_covered(network[, masklen][, packed] -> None\n\
+PyDoc_STRVAR(Radix_reduce_doc,
+"Radix.__reduce__() -> tuple\n\
 \n\
-FIXME");
+Helper for pickle; pairs an empty-tree constructor with the state\n\
+from Radix.__getstate__().");
 
 static PyObject *
-Radix_search_covered(RadixObject *self, PyObject *args, PyObject *kw_args)
+Radix_reduce(RadixObject *self, PyObject *unused)
 {
-        prefix_t lprefix, *prefix;
-        PyObject *ret;
-
-        static char *keywords[] = { "network", "masklen", "packed", NULL };
-
-        char *addr = NULL, *packed = NULL;
-        long prefixlen = -1;
-        Py_ssize_t packlen = -1;
+        PyObject *state;
 
-        if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|zlz#:search_covered", keywords, &addr, &prefixlen, &packed, &packlen))
+        if ((state = Radix_getstate(self, NULL)) == NULL)
                 return NULL;
+        if (self->value_mode)
+                return Py_BuildValue("(O(s)N)", radix_constructor,
+                    "object", state);
+        return Py_BuildValue("(O()N)", radix_constructor, state);
+}
 
-        if ((prefix = args_to_prefix(&lprefix, addr, packed, packlen, prefixlen)) == NULL)
-                return NULL;
-
-        if ((ret = PyList_New(0)) == NULL)
-                return NULL;
-
-        radix_search_covered(self->rt, prefix, add_node_to_list, ret, 1);
-
-        return (ret);
+static void
+relocate_node_cb(radix_node_t *node, void *cbctx)
+{
+        ((RadixNodeObject *)node->data)->rn = node;
 }
 
-PyDoc_STRVAR(Radix_search_covering_doc,
-"Radix.search_covering(network[, masklen][, packed] -> List of RadixNode\n\
-\n\
-Returns a list of nodes with a less specific or same prefix than network.\n\
+PyDoc_STRVAR(Radix_freeze_doc,
+"Radix.freeze() -> None\n\
 \n\
-If no match is found, then returns an empty list.");
+Compacts the tree into a read-optimized layout: all nodes are\n\
+relocated into one contiguous block in BFS order with their prefixes\n\
+packed alongside, so lookups touch far fewer cache lines. The tree\n\
+becomes read-only; add() and delete() raise RuntimeError until\n\
+unfreeze() is called. Searches and iteration work as usual.");
 
 static PyObject *
-Radix_search_covering(RadixObject *self, PyObject *args, PyObject *kw_args)
+Radix_freeze(RadixObject *self, PyObject *args)
 {
-        prefix_t lprefix, *prefix;
-        PyObject *ret;
-
-        static char *keywords[] = { "network", "masklen", "packed", NULL };
-
-        char *addr = NULL, *packed = NULL;
-        long prefixlen = -1;
-        Py_ssize_t packlen = -1;
-
-        if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|zlz#:search_covering", keywords, &addr, &prefixlen, &packed, &packlen)) {
+        if (!PyArg_ParseTuple(args, ":freeze"))
                 return NULL;
+
+        if (!self->frozen) {
+                if (check_writable(self) == -1)
+                        return NULL;
+                if (radix_compact(self->rt, relocate_node_cb, NULL) == -1)
+                        return PyErr_NoMemory();
+                if (radix_build_direct(self->rt) == -1)
+                        return PyErr_NoMemory();
+                /* relocation invalidates any live iterators */
+                self->gen_id++;
+                self->frozen = 1;
         }
+        Py_RETURN_NONE;
+}
 
-        if ((prefix = args_to_prefix(&lprefix, addr, packed, packlen, prefixlen)) == NULL) {
+PyDoc_STRVAR(Radix_unfreeze_doc,
+"Radix.unfreeze() -> None\n\
+\n\
+Makes a frozen tree modifiable again. The compact layout is kept\n\
+until subsequent modifications grow new pool blocks.");
+
+static PyObject *
+Radix_unfreeze(RadixObject *self, PyObject *args)
+{
+        if (!PyArg_ParseTuple(args, ":unfreeze"))
                 return NULL;
-        }
 
-        if ((ret = PyList_New(0)) == NULL) {
+        if (self->readers != 0) {
+                PyErr_SetString(PyExc_RuntimeError,
+                    "Radix tree is busy: batch readers are active in "
+                    "other threads");
                 return NULL;
         }
-
-        radix_search_covering(self->rt, prefix, add_node_to_list, ret);
-
-        return ret;
+        radix_free_direct(self->rt);
+        self->frozen = 0;
+        Py_RETURN_NONE;
 }
 
-PyDoc_STRVAR(Radix_nodes_doc,
-"Radix.nodes(prefix) -> List of RadixNode\n\
+PyDoc_STRVAR(Radix_set_lpm_cache_doc,
+"Radix.set_lpm_cache(size=8192) -> None\n\
 \n\
-Returns a list containing all the RadixNode objects that have been\n\
-entered into the tree. This list may be empty if no prefixes have\n\
-been entered.");
+Enables a result cache in front of search_best(): repeated lookups\n\
+of the same address are answered from a direct-mapped table keyed\n\
+by the packed address instead of re-walking the trie, which pays\n\
+off on query streams with strong temporal locality. 'size' (rounded\n\
+up to a power of two) is the number of cached addresses; 0 disables\n\
+the cache. Any modification of the tree invalidates all entries.\n\
+Hit/miss counters appear in Radix.stats() while enabled.");
 
 static PyObject *
-Radix_nodes(RadixObject *self, PyObject *args)
+Radix_set_lpm_cache(RadixObject *self, PyObject *args, PyObject *kw_args)
 {
-        radix_node_t *node;
-        PyObject *ret;
+        static char *keywords[] = { "size", NULL };
+        long size = 8192;
+        unsigned int n;
 
-        if (!PyArg_ParseTuple(args, ":nodes"))
+        if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|l:set_lpm_cache",
+            keywords, &size))
                 return NULL;
-
-        if ((ret = PyList_New(0)) == NULL)
+        if (size < 0 || size > (1L << 24)) {
+                PyErr_SetString(PyExc_ValueError,
+                    "cache size must be between 0 and 2**24");
                 return NULL;
+        }
 
-        RADIX_TREE_WALK(self->rt, node) {
-                if (node->data != NULL)
-                        PyList_Append(ret, (PyObject *)node->data);
-        } RADIX_TREE_WALK_END;
+        PyMem_Free(self->cache);
+        self->cache = NULL;
+        self->cache_mask = 0;
+        self->cache_hits = self->cache_misses = 0;
+        if (size == 0)
+                Py_RETURN_NONE;
+
+        for (n = 1; n < (unsigned int)size; n <<= 1)
+                ;
+        if ((self->cache = PyMem_Malloc(n *
+            sizeof(lpm_cache_ent_t))) == NULL)
+                return PyErr_NoMemory();
+        memset(self->cache, '\0', n * sizeof(lpm_cache_ent_t));
+        self->cache_mask = n - 1;
+        Py_RETURN_NONE;
+}
 
-        return (ret);
+/*
+ * Sequence and mapping protocol: len() comes from a maintained count,
+ * membership and item access go through exact searches, so the common
+ * idioms cost O(depth) instead of a full materializing walk. Keys are
+ * CIDR strings or packed addresses, values are node data dicts.
+ */
+
+static Py_ssize_t
+Radix_length(RadixObject *self)
+{
+        return (Py_ssize_t)self->rt->num_prefixes;
 }
 
-PyDoc_STRVAR(Radix_prefixes_doc,
-"Radix.prefixes(prefix) -> List of prefix strings\n\
-\n\
-Returns a list containing all the prefixes that have been entered\n\
-into the tree. This list may be empty if no prefixes have been\n\
-entered.");
+static int
+Radix_contains(RadixObject *self, PyObject *arg)
+{
+        prefix_t prefix;
+        radix_node_t *node;
+
+        if (parse_prefix_item(arg, &prefix) == -1)
+                return -1;
+        node = radix_search_exact(self->rt, &prefix);
+        return (node != NULL && node->data != NULL);
+}
 
 static PyObject *
-Radix_prefixes(RadixObject *self, PyObject *args)
+Radix_subscript(RadixObject *self, PyObject *key)
 {
+        prefix_t prefix;
         radix_node_t *node;
-        PyObject *ret;
 
-        if (!PyArg_ParseTuple(args, ":prefixes"))
+        if (parse_prefix_item(key, &prefix) == -1)
                 return NULL;
-
-        if ((ret = PyList_New(0)) == NULL)
+        if ((node = radix_search_exact(self->rt, &prefix)) == NULL ||
+            node->data == NULL) {
+                PyErr_SetObject(PyExc_KeyError, key);
                 return NULL;
+        }
+        if (self->value_mode)
+                return RadixNode_value_get((RadixNodeObject *)node->data,
+                    NULL);
+        return RadixNode_data((RadixNodeObject *)node->data, NULL);
+}
 
-        RADIX_TREE_WALK(self->rt, node) {
+static int
+Radix_ass_subscript(RadixObject *self, PyObject *key, PyObject *value)
+{
+        prefix_t prefix;
+        radix_node_t *node;
+        RadixNodeObject *node_obj;
+
+        if (check_writable(self) == -1)
+                return -1;
+        if (parse_prefix_item(key, &prefix) == -1)
+                return -1;
+        if (value == NULL) {
+                if ((node = radix_search_exact(self->rt,
+                    &prefix)) == NULL) {
+                        PyErr_SetObject(PyExc_KeyError, key);
+                        return -1;
+                }
                 if (node->data != NULL) {
-                        PyList_Append(ret,
-                            ((RadixNodeObject *)node->data)->prefix);
+                        node_obj = node->data;
+                        node_obj->rn = NULL;
+                        Py_XDECREF(node_obj);
                 }
-        } RADIX_TREE_WALK_END;
-
-        return (ret);
+                radix_remove(self->rt, node);
+                self->gen_id++;
+                return 0;
+        }
+        if (!self->value_mode && !PyDict_Check(value)) {
+                PyErr_SetString(PyExc_TypeError,
+                    "Radix node data must be a dict");
+                return -1;
+        }
+        if ((node = radix_lookup(self->rt, &prefix)) == NULL) {
+                PyErr_SetString(PyExc_MemoryError, "Couldn't add prefix");
+                return -1;
+        }
+        if (node->data == NULL) {
+                if ((node_obj = newRadixNodeObject(node,
+                    self->value_mode)) == NULL)
+                        return -1;
+                node->data = node_obj;
+        } else
+                node_obj = node->data;
+        Py_INCREF(value);
+        Py_XDECREF(node_obj->user_attr);
+        node_obj->user_attr = value;
+        self->gen_id++;
+        return 0;
 }
 
+static PySequenceMethods Radix_as_sequence = {
+        (lenfunc)Radix_length,          /*sq_length*/
+        0,                              /*sq_concat*/
+        0,                              /*sq_repeat*/
+        0,                              /*sq_item*/
+        0,                              /*sq_slice*/
+        0,                              /*sq_ass_item*/
+        0,                              /*sq_ass_slice*/
+        (objobjproc)Radix_contains,     /*sq_contains*/
+        0,                              /*sq_inplace_concat*/
+        0,                              /*sq_inplace_repeat*/
+};
+
+static PyMappingMethods Radix_as_mapping = {
+        (lenfunc)Radix_length,          /*mp_length*/
+        (binaryfunc)Radix_subscript,    /*mp_subscript*/
+        (objobjargproc)Radix_ass_subscript, /*mp_ass_subscript*/
+};
+
 static PyObject *
 Radix_getiter(RadixObject *self)
 {
         return (PyObject *)newRadixIterObject(self);
 }
 
+PyDoc_STRVAR(Radix_iternodes_doc,
+"Radix.iternodes(family=0, within=None, minlen=-1, maxlen=-1) -> iterator\n\
+\n\
+Like iter(radix), but with the filters applied inside the C walk:\n\
+'family' restricts the walk to one address family, 'within' (a CIDR\n\
+string) yields only prefixes covered by it and starts the walk at\n\
+that subtree, and 'minlen'/'maxlen' bound the prefix length. Only\n\
+matching nodes are materialized.");
+
+static PyObject *
+Radix_iternodes(RadixObject *self, PyObject *args, PyObject *kw_args)
+{
+        static char *keywords[] = { "family", "within", "minlen", "maxlen",
+            NULL };
+        const char *within = NULL, *errmsg;
+        int family = 0, minlen = -1, maxlen = -1;
+        prefix_t wpfx;
+
+        if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|izii:iternodes",
+            keywords, &family, &within, &minlen, &maxlen))
+                return NULL;
+        if (family != 0 && family != AF_INET && family != AF_INET6) {
+                PyErr_SetString(PyExc_ValueError,
+                    "family must be AF_INET or AF_INET6");
+                return NULL;
+        }
+        if (within != NULL) {
+                if (prefix_pton_ex(&wpfx, within, -1, &errmsg) == NULL) {
+                        PyErr_SetString(PyExc_ValueError, errmsg);
+                        return NULL;
+                }
+                if (family != 0 && family != (int)wpfx.family) {
+                        PyErr_SetString(PyExc_ValueError,
+                            "within prefix does not match family");
+                        return NULL;
+                }
+                family = wpfx.family;
+        }
+        return (PyObject *)newRadixIterObject2(self, family,
+            within != NULL ? &wpfx : NULL, minlen, maxlen);
+}
+
 PyDoc_STRVAR(Radix_doc, "Radix tree");
 
 static PyMethodDef Radix_methods[] = {
         {"add",         (PyCFunction)Radix_add,         METH_VARARGS|METH_KEYWORDS,     Radix_add_doc           },
+        {"add_many",    (PyCFunction)Radix_add_many,    METH_VARARGS,                   Radix_add_many_doc      },
+        {"update",      (PyCFunction)Radix_update,      METH_VARARGS|METH_KEYWORDS,     Radix_update_doc        },
+        {"load_text",   (PyCFunction)Radix_load_text,   METH_VARARGS|METH_KEYWORDS,     Radix_load_text_doc     },
+        {"build",       (PyCFunction)Radix_build,       METH_VARARGS|METH_KEYWORDS,     Radix_build_doc         },
+        {"clear",       (PyCFunction)Radix_clear,       METH_VARARGS|METH_KEYWORDS,     Radix_clear_doc         },
         {"delete",      (PyCFunction)Radix_delete,      METH_VARARGS|METH_KEYWORDS,     Radix_delete_doc        },
         {"search_exact",(PyCFunction)Radix_search_exact,METH_VARARGS|METH_KEYWORDS,     Radix_search_exact_doc  },
         {"search_best", (PyCFunction)Radix_search_best, METH_VARARGS|METH_KEYWORDS,     Radix_search_best_doc   },
+        {"search_best_many", (PyCFunction)Radix_search_best_many, METH_VARARGS,         Radix_search_best_many_doc },
+        {"search_best_packed", (PyCFunction)Radix_search_best_packed, METH_FASTCALL,    Radix_search_best_packed_doc },
+        {"search_exact_packed", (PyCFunction)Radix_search_exact_packed, METH_FASTCALL,  Radix_search_exact_packed_doc },
         {"search_worst", (PyCFunction)Radix_search_worst, METH_VARARGS|METH_KEYWORDS,     Radix_search_worst_doc   },
         {"search_covered", (PyCFunction)Radix_search_covered, METH_VARARGS|METH_KEYWORDS,     Radix_search_covered_doc   },
         {"search_covering",(PyCFunction)Radix_search_covering, METH_VARARGS|METH_KEYWORDS,     Radix_search_covering_doc },
+        {"snapshot",    (PyCFunction)Radix_snapshot,    METH_VARARGS,                   Radix_snapshot_doc      },
+        {"load_snapshot", (PyCFunction)Radix_load_snapshot, METH_VARARGS,               Radix_load_snapshot_doc },
+        {"__getstate__", (PyCFunction)Radix_getstate,   METH_NOARGS,                    Radix_getstate_doc      },
+        {"__setstate__", (PyCFunction)Radix_setstate,   METH_O,                         Radix_setstate_doc      },
+        {"__reduce__",  (PyCFunction)Radix_reduce,      METH_NOARGS,                    Radix_reduce_doc        },
+        {"freeze",      (PyCFunction)Radix_freeze,      METH_VARARGS,                   Radix_freeze_doc        },
+        {"unfreeze",    (PyCFunction)Radix_unfreeze,    METH_VARARGS,                   Radix_unfreeze_doc      },
+        {"set_lpm_cache", (PyCFunction)Radix_set_lpm_cache, METH_VARARGS|METH_KEYWORDS, Radix_set_lpm_cache_doc },
+        {"aggregate",   (PyCFunction)Radix_aggregate,   METH_VARARGS|METH_KEYWORDS,     Radix_aggregate_doc     },
+        {"union",       (PyCFunction)Radix_union,       METH_O,                         Radix_union_doc         },
+        {"intersection",(PyCFunction)Radix_intersection,METH_O,                         Radix_intersection_doc  },
+        {"difference",  (PyCFunction)Radix_difference,  METH_O,                         Radix_difference_doc    },
+        {"iternodes",   (PyCFunction)Radix_iternodes,   METH_VARARGS|METH_KEYWORDS,     Radix_iternodes_doc     },
+        {"stats",       (PyCFunction)Radix_stats,       METH_VARARGS,                   Radix_stats_doc         },
         {"nodes",       (PyCFunction)Radix_nodes,       METH_VARARGS,                   Radix_nodes_doc         },
         {"prefixes",    (PyCFunction)Radix_prefixes,    METH_VARARGS,                   Radix_prefixes_doc      },
         {NULL,          NULL}           /* sentinel */
@@ -688,8 +3005,8 @@ static PyTypeObject Radix_Type = {
         0,                      /*tp_compare*/
         0,                      /*tp_repr*/
         0,                      /*tp_as_number*/
-        0,                      /*tp_as_sequence*/
-        0,                      /*tp_as_mapping*/
+        &Radix_as_sequence,     /*tp_as_sequence*/
+        &Radix_as_mapping,      /*tp_as_mapping*/
         0,                      /*tp_hash*/
         0,                      /*tp_call*/
         0,                      /*tp_str*/
@@ -730,6 +3047,11 @@ typedef struct _RadixIterObject {
         radix_node_t **sp;
         radix_node_t *rn;
         int af;
+        int only_af;            /* walk a single family (0 = both) */
+        int minlen;             /* inclusive prefixlen bounds */
+        int maxlen;
+        prefix_t within;        /* yield covered prefixes only */
+        int has_within;
         unsigned int gen_id;    /* Detect tree modifications */
 } RadixIterObject;
 
@@ -751,6 +3073,36 @@ newRadixIterObject(RadixObject *parent)
         self->rn = self->parent->rt->head_ipv4;
         self->gen_id = self->parent->gen_id;
         self->af = AF_INET;
+        self->only_af = 0;
+        self->minlen = 0;
+        self->maxlen = RADIX_MAXBITS;
+        self->has_within = 0;
+        return self;
+}
+
+static RadixIterObject *
+newRadixIterObject2(RadixObject *parent, int family, prefix_t *within,
+    int minlen, int maxlen)
+{
+        RadixIterObject *self;
+
+        if ((self = newRadixIterObject(parent)) == NULL)
+                return NULL;
+        self->only_af = family;
+        if (family == AF_INET6) {
+                self->af = AF_INET6;
+                self->rn = parent->rt->head_ipv6;
+        }
+        if (minlen >= 0)
+                self->minlen = minlen;
+        if (maxlen >= 0)
+                self->maxlen = maxlen;
+        if (within != NULL) {
+                self->within = *within;
+                self->has_within = 1;
+                /* start directly at the covered subtree */
+                self->rn = radix_subtree(parent->rt, &self->within);
+        }
         return self;
 }
 
@@ -778,7 +3130,7 @@ RadixIter_iternext(RadixIterObject *self)
  again:
         if ((node = self->rn) == NULL) {
                 /* We have walked both trees */
-                if (self->af == AF_INET6)
+                if (self->af == AF_INET6 || self->only_af == AF_INET)
                         return NULL;
                 /* Otherwise reset and start walk of IPv6 tree */
                 self->sp = self->iterstack;
@@ -801,6 +3153,12 @@ RadixIter_iternext(RadixIterObject *self)
 
         if (node->prefix == NULL || node->data == NULL)
                 goto again;
+        if ((int)node->prefix->bitlen < self->minlen ||
+            (int)node->prefix->bitlen > self->maxlen)
+                goto again;
+        if (self->has_within &&
+            !prefix_covered(node->prefix, &self->within))
+                goto again;
 
         ret = node->data;
         Py_INCREF(ret);
@@ -839,7 +3197,7 @@ static PyTypeObject RadixIter_Type = {
         0,                      /*tp_clear*/
         0,                      /*tp_richcompare*/
         0,                      /*tp_weaklistoffset*/
-        0,                      /*tp_iter*/
+        PyObject_SelfIter,      /*tp_iter*/
         (iternextfunc)RadixIter_iternext, /*tp_iternext*/
         0,                      /*tp_methods*/
         0,                      /*tp_members*/
@@ -860,26 +3218,198 @@ static PyTypeObject RadixIter_Type = {
 
 /* Radix object creator */
 
+/* ------------------------------------------------------------------------ */
+
+/*
+ * RadixSnapshot: read-only best-match search over an external snapshot
+ * buffer (as produced by Radix.snapshot()). The buffer is searched in
+ * place and never written, and the object holds no per-node Python
+ * state, so the pages can live in a shared-memory segment mapped by
+ * any number of worker processes without being duplicated or dirtied.
+ */
+
+typedef struct {
+        PyObject_HEAD
+        Py_buffer view;         /* keeps the underlying buffer alive */
+        u_int32_t num_prefixes;
+} RadixSnapshotObject;
+
+static PyTypeObject RadixSnapshot_Type;
+
+static void
+RadixSnapshot_dealloc(RadixSnapshotObject *self)
+{
+        PyBuffer_Release(&self->view);
+        PyObject_Del(self);
+}
+
+PyDoc_STRVAR(RadixSnapshot_search_best_doc,
+"RadixSnapshot.search_best(network[, masklen][, packed]) -> str or None\n\
+\n\
+Returns the longest prefix in the snapshot that contains the given\n\
+address, as a CIDR string, or None. Snapshots carry no user data\n\
+dicts, so there is no RadixNode to return.");
+
+static PyObject *
+RadixSnapshot_search_best(RadixSnapshotObject *self, PyObject *args,
+    PyObject *kw_args)
+{
+        prefix_t lprefix, *prefix, match;
+        char buf[256];
+        static char *keywords[] = { "network", "masklen", "packed", NULL };
+
+        char *addr = NULL, *packed = NULL;
+        long prefixlen = -1;
+        Py_ssize_t packlen = -1;
+
+        if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|zlz#:search_best", keywords,
+            &addr, &prefixlen, &packed, &packlen))
+                return NULL;
+        if ((prefix = args_to_prefix(&lprefix, addr, packed, packlen, prefixlen)) == NULL)
+                return NULL;
+
+        if (radix_snapshot_search_best(self->view.buf, prefix,
+            &match) == 0) {
+                Py_INCREF(Py_None);
+                return Py_None;
+        }
+        if (prefix_ntop(&match, buf, sizeof(buf)) == NULL) {
+                PyErr_SetString(PyExc_RuntimeError,
+                    "invalid prefix in snapshot");
+                return NULL;
+        }
+        return PyUnicode_FromString(buf);
+}
+
+static Py_ssize_t
+RadixSnapshot_length(RadixSnapshotObject *self)
+{
+        return self->num_prefixes;
+}
+
+static PyMethodDef RadixSnapshot_methods[] = {
+        {"search_best", (PyCFunction)RadixSnapshot_search_best,
+                        METH_VARARGS|METH_KEYWORDS, RadixSnapshot_search_best_doc },
+        {NULL,          NULL}           /* sentinel */
+};
+
+static PySequenceMethods RadixSnapshot_as_sequence = {
+        (lenfunc)RadixSnapshot_length,  /*sq_length*/
+};
+
+static PyTypeObject RadixSnapshot_Type = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+        "_radix.RadixSnapshot",  /*tp_name*/
+        sizeof(RadixSnapshotObject), /*tp_basicsize*/
+        0,                      /*tp_itemsize*/
+        /* methods */
+        (destructor)RadixSnapshot_dealloc, /*tp_dealloc*/
+        0,                      /*tp_print*/
+        0,                      /*tp_getattr*/
+        0,                      /*tp_setattr*/
+        0,                      /*tp_compare*/
+        0,                      /*tp_repr*/
+        0,                      /*tp_as_number*/
+        &RadixSnapshot_as_sequence, /*tp_as_sequence*/
+        0,                      /*tp_as_mapping*/
+        0,                      /*tp_hash*/
+        0,                      /*tp_call*/
+        0,                      /*tp_str*/
+        0,                      /*tp_getattro*/
+        0,                      /*tp_setattro*/
+        0,                      /*tp_as_buffer*/
+        Py_TPFLAGS_DEFAULT,     /*tp_flags*/
+        0,                      /*tp_doc*/
+        0,                      /*tp_traverse*/
+        0,                      /*tp_clear*/
+        0,                      /*tp_richcompare*/
+        0,                      /*tp_weaklistoffset*/
+        0,                      /*tp_iter*/
+        0,                      /*tp_iternext*/
+        RadixSnapshot_methods,  /*tp_methods*/
+        0,                      /*tp_members*/
+        0,                      /*tp_getset*/
+        0,                      /*tp_base*/
+        0,                      /*tp_dict*/
+        0,                      /*tp_descr_get*/
+        0,                      /*tp_descr_set*/
+        0,                      /*tp_dictoffset*/
+        0,                      /*tp_init*/
+        0,                      /*tp_alloc*/
+        0,                      /*tp_new*/
+        0,                      /*tp_free*/
+        0,                      /*tp_is_gc*/
+};
+
+PyDoc_STRVAR(radix_RadixSnapshot_doc,
+"RadixSnapshot(buffer) -> read-only snapshot search object\n\
+\n\
+Wraps a buffer produced by Radix.snapshot() (a bytes object, an\n\
+mmap, or a shared-memory view) for in-place best-match searching.\n\
+The buffer is validated once up front and never copied or written.");
+
+static PyObject *
+radix_RadixSnapshot(PyObject *self, PyObject *args)
+{
+        RadixSnapshotObject *rv;
+        Py_buffer view;
+        u_int32_t npfx;
+
+        if (!PyArg_ParseTuple(args, "y*:RadixSnapshot", &view))
+                return NULL;
+        if (radix_snapshot_valid(view.buf, view.len, &npfx) == -1) {
+                PyBuffer_Release(&view);
+                PyErr_SetString(PyExc_ValueError,
+                    "invalid or corrupt snapshot");
+                return NULL;
+        }
+        if ((rv = PyObject_New(RadixSnapshotObject,
+            &RadixSnapshot_Type)) == NULL) {
+                PyBuffer_Release(&view);
+                return NULL;
+        }
+        rv->view = view;
+        rv->num_prefixes = npfx;
+        return (PyObject *)rv;
+}
+
+/* ------------------------------------------------------------------------ */
+
 PyDoc_STRVAR(radix_Radix_doc,
-"Radix() -> new Radix tree object\n\
+"Radix(value_mode='dict') -> new Radix tree object\n\
 \n\
-Instantiate a new radix tree object.");
+Instantiate a new radix tree object. With value_mode='object' each\n\
+node stores a single value set via node.value or rtree[prefix] = x\n\
+instead of a per-node data dict, which roughly halves the resident\n\
+memory of a large table holding one scalar per prefix (an AS number,\n\
+a policy id) and keeps the values out of GC traversal.");
 
 static PyObject *
-radix_Radix(PyObject *self, PyObject *args)
+radix_Radix(PyObject *self, PyObject *args, PyObject *kw_args)
 {
+        static char *keywords[] = { "value_mode", NULL };
+        char *mode = "dict";
         RadixObject *rv;
 
-        if (!PyArg_ParseTuple(args, ":Radix"))
+        if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|s:Radix",
+            keywords, &mode))
+                return NULL;
+        if (strcmp(mode, "dict") != 0 && strcmp(mode, "object") != 0) {
+                PyErr_SetString(PyExc_ValueError,
+                    "value_mode must be 'dict' or 'object'");
                 return NULL;
+        }
         rv = newRadixObject();
         if (rv == NULL)
                 return NULL;
+        rv->value_mode = (mode[0] == 'o');
         return (PyObject *)rv;
 }
 
 static PyMethodDef radix_methods[] = {
-        {"Radix",       radix_Radix,    METH_VARARGS,   radix_Radix_doc },
+        {"Radix",       (PyCFunction)radix_Radix, METH_VARARGS|METH_KEYWORDS,
+            radix_Radix_doc },
+        {"RadixSnapshot", radix_RadixSnapshot, METH_VARARGS, radix_RadixSnapshot_doc },
         {NULL,          NULL}           /* sentinel */
 };
 
@@ -988,6 +3518,8 @@ static PyObject *module_initialize(void)
                 return NULL;
         if (PyType_Ready(&RadixNode_Type) < 0)
                 return NULL;
+        if (PyType_Ready(&RadixSnapshot_Type) < 0)
+                return NULL;
 #if PY_MAJOR_VERSION >= 3
         m = PyModule_Create(&radix_module_def);
 #else
@@ -106,17 +106,55 @@
  * $MRTId: prefix.c,v 1.1.1.1 2000/08/14 18:46:11 labovit Exp $
  */
 
+/* count of leading zero bits; the argument must be non-zero */
+static u_int
+radix_clz32(u_int32_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+        return ((u_int)__builtin_clz(x));
+#else
+        u_int n = 0;
+
+        while ((x & 0x80000000U) == 0) {
+                x <<= 1;
+                n++;
+        }
+        return (n);
+#endif
+}
+
+/*
+ * Like comp_with_mask() but skips the words below bit 'from', which the
+ * caller has already confirmed equal; the top-down best-match walk uses
+ * this because each deeper candidate shares its ancestor's leading
+ * bits. Both arguments always point at the 16-byte address union
+ * inside a prefix_t, so comparing whole 32-bit words never reads out
+ * of bounds even for AF_INET.
+ */
 static int
-comp_with_mask(u_char *addr, u_char *dest, u_int mask)
+comp_with_mask_from(u_char *addr, u_char *dest, u_int mask, u_int from)
 {
-        if (memcmp(addr, dest, mask / 8) == 0) {
-                u_int n = mask / 8;
-                u_int m = ((~0) << (8 - (mask % 8)));
+        u_int32_t wa, wb, m;
+        u_int i, whole = mask / 32;
 
-                if (mask % 8 == 0 || (addr[n] & m) == (dest[n] & m))
-                        return (1);
+        for (i = from / 32; i < whole; i++) {
+                memcpy(&wa, addr + i * 4, 4);
+                memcpy(&wb, dest + i * 4, 4);
+                if (wa != wb)
+                        return (0);
         }
-        return (0);
+        if (mask % 32 == 0)
+                return (1);
+        memcpy(&wa, addr + whole * 4, 4);
+        memcpy(&wb, dest + whole * 4, 4);
+        m = htonl(~0U << (32 - mask % 32));
+        return ((wa & m) == (wb & m));
+}
+
+static int
+comp_with_mask(u_char *addr, u_char *dest, u_int mask)
+{
+        return (comp_with_mask_from(addr, dest, mask, 0));
 }
 
 static prefix_t 
@@ -128,7 +166,7 @@ static prefix_t
         if (family == AF_INET6) {
                 default_bitlen = 128;
                 if (prefix == NULL) {
-                        if ((prefix = PyMem_Malloc(sizeof(*prefix))) == NULL)
+                        if ((prefix = PyMem_RawMalloc(sizeof(*prefix))) == NULL)
                                 return (NULL);
                         memset(prefix, '\0', sizeof(*prefix));
                         dynamic_allocated++;
@@ -136,7 +174,7 @@ static prefix_t
                 memcpy(&prefix->add.sin6, dest, 16);
         } else if (family == AF_INET) {
                 if (prefix == NULL) {
-                        if ((prefix = PyMem_Malloc(sizeof(*prefix))) == NULL)
+                        if ((prefix = PyMem_RawMalloc(sizeof(*prefix))) == NULL)
                                 return (NULL);
                         memset(prefix, '\0', sizeof(*prefix));
                         dynamic_allocated++;
@@ -154,21 +192,6 @@ static prefix_t
 }
 
 
-static prefix_t 
-*Ref_Prefix(prefix_t *prefix)
-{
-        if (prefix == NULL)
-                return (NULL);
-        if (prefix->ref_count == 0) {
-                /* make a copy in case of a static prefix */
-                return (New_Prefix2(prefix->family, &prefix->add,
-                    prefix->bitlen, NULL));
-        }
-        prefix->ref_count++;
-        return (prefix);
-}
-
-
 void
 Deref_Prefix(prefix_t *prefix)
 {
@@ -176,11 +199,92 @@ Deref_Prefix(prefix_t *prefix)
                 return;
         prefix->ref_count--;
         if (prefix->ref_count <= 0) {
-                PyMem_Free(prefix);
+                PyMem_RawFree(prefix);
                 return;
         }
 }
 
+/*
+ * Slab allocator: tiny fixed-size entries (radix_node_t, prefix_t) are
+ * carved out of large blocks owned by the tree, so a full-table load is
+ * a few big PyMem_RawMalloc() calls instead of millions of tiny ones, and
+ * teardown is a handful of block frees. The raw allocator is used
+ * throughout this file so trees can be built and torn down by worker
+ * threads that do not hold the GIL.
+ */
+#define RADIX_POOL_MINENTRIES   512
+#define RADIX_POOL_MAXENTRIES   65536
+
+static void
+radix_pool_init(radix_pool_t *pool, size_t size)
+{
+        memset(pool, '\0', sizeof(*pool));
+        pool->size = size;
+        pool->perblock = RADIX_POOL_MINENTRIES;
+}
+
+/* release every slab and return the pool to its initial state */
+static void
+radix_pool_reset(radix_pool_t *pool)
+{
+        radix_pool_block_t *block, *next;
+
+        for (block = pool->blocks; block != NULL; block = next) {
+                next = block->next;
+                PyMem_RawFree(block);
+        }
+        radix_pool_init(pool, pool->size);
+}
+
+static void *
+radix_pool_get(radix_pool_t *pool)
+{
+        radix_pool_block_t *block;
+        void *ret;
+
+        if (pool->freelist != NULL) {
+                ret = pool->freelist;
+                pool->freelist = *(void **)ret;
+                return (ret);
+        }
+        if (pool->brk >= pool->end) {
+                if ((block = PyMem_RawMalloc(sizeof(*block) +
+                    pool->size * pool->perblock)) == NULL)
+                        return (NULL);
+                pool->allocated += sizeof(*block) +
+                    pool->size * pool->perblock;
+                block->next = pool->blocks;
+                pool->blocks = block;
+                pool->brk = (u_char *)(block + 1);
+                pool->end = pool->brk + pool->size * pool->perblock;
+                if (pool->perblock < RADIX_POOL_MAXENTRIES)
+                        pool->perblock *= 2;
+        }
+        ret = pool->brk;
+        pool->brk += pool->size;
+        return (ret);
+}
+
+static void
+radix_pool_put(radix_pool_t *pool, void *p)
+{
+        *(void **)p = pool->freelist;
+        pool->freelist = p;
+}
+
+/* tree-owned copy of a caller's prefix, carved from the prefix pool */
+static prefix_t *
+radix_prefix_dup(radix_tree_t *radix, prefix_t *prefix)
+{
+        prefix_t *ret;
+
+        if ((ret = radix_pool_get(&radix->prefix_pool)) == NULL)
+                return (NULL);
+        memcpy(ret, prefix, sizeof(*ret));
+        ret->ref_count = 1;
+        return (ret);
+}
+
 /*
  * Originally from MRT lib/radix/radix.c
  * $MRTId: radix.c,v 1.1.1.1 2000/08/14 18:46:13 labovit Exp $
@@ -193,16 +297,517 @@ radix_tree_t
 {
         radix_tree_t *radix;
 
-        if ((radix = PyMem_Malloc(sizeof(*radix))) == NULL)
+        if ((radix = PyMem_RawMalloc(sizeof(*radix))) == NULL)
                 return (NULL);
         memset(radix, '\0', sizeof(*radix));
 
         radix->head_ipv4 = NULL;
         radix->head_ipv6 = NULL;
         radix->num_active_node = 0;
+        radix_pool_init(&radix->node_pool, sizeof(radix_node_t));
+        radix_pool_init(&radix->prefix_pool, sizeof(prefix_t));
         return (radix);
 }
 
+/*
+ * Build the IPv4 direct-index (stride) table for a frozen tree: for
+ * each of the 2^16 top-16-bit chunks, precompute where the bit-by-bit
+ * walk would stand after the first 16 levels and which prefix of
+ * length <= 16 is the longest match for the chunk. Best-match lookups
+ * then resolve the top of the trie in one table load.
+ */
+int
+radix_build_direct(radix_tree_t *radix)
+{
+        radix_direct_t *direct;
+        radix_node_t *node;
+        u_char chunk[2], *addr;
+        u_int idx, base, span, i;
+
+        radix_free_direct(radix);
+        if (radix->head_ipv4 == NULL)
+                return (0);
+
+        if ((direct = PyMem_RawMalloc(RADIX_DIRECT_SIZE *
+            sizeof(*direct))) == NULL)
+                return (-1);
+        memset(direct, '\0', RADIX_DIRECT_SIZE * sizeof(*direct));
+
+        /*
+         * Preorder walk visits covering prefixes before covered ones,
+         * so longer prefixes overwrite their parents' table ranges.
+         */
+        RADIX_WALK(radix->head_ipv4, node) {
+                if (node->prefix->bitlen <= RADIX_DIRECT_BITS) {
+                        addr = prefix_touchar(node->prefix);
+                        base = ((u_int)addr[0] << 8) | addr[1];
+                        span = 1 << (RADIX_DIRECT_BITS -
+                            node->prefix->bitlen);
+                        for (i = 0; i < span; i++)
+                                direct[base + i].best = node;
+                }
+        } RADIX_WALK_END;
+
+        for (idx = 0; idx < RADIX_DIRECT_SIZE; idx++) {
+                chunk[0] = idx >> 8;
+                chunk[1] = idx & 0xff;
+                node = radix->head_ipv4;
+                while (node != NULL && node->bit < RADIX_DIRECT_BITS)
+                        node = BIT_TEST_SEARCH_BIT(chunk, node->bit) ?
+                            node->r : node->l;
+                direct[idx].start = node;
+        }
+
+        radix->direct_ipv4 = direct;
+        return (0);
+}
+
+void
+radix_free_direct(radix_tree_t *radix)
+{
+        if (radix->direct_ipv4 != NULL) {
+                PyMem_RawFree(radix->direct_ipv4);
+                radix->direct_ipv4 = NULL;
+        }
+}
+
+/*
+ * Flat snapshot format: a fixed header followed by one fixed-size
+ * record per node (including glue nodes) in BFS order, with child and
+ * parent links as 1-based record indices and 0 meaning "none". The
+ * format is versioned and native-endian; loading reconstructs the
+ * pools in a single pass with no per-prefix parsing, so a saved table
+ * can be mapped and loaded nearly instantly. User data dicts are not
+ * part of a snapshot.
+ */
+#define RADIX_SNAP_MAGIC        "RDXS"
+#define RADIX_SNAP_VERSION      1
+
+typedef struct _radix_snap_hdr_t {
+        char magic[4];
+        u_int32_t version;
+        u_int32_t count;                /* number of node records */
+        u_int32_t head4;                /* 1-based index or 0 */
+        u_int32_t head6;
+} radix_snap_hdr_t;
+
+typedef struct _radix_snap_node_t {
+        u_int32_t bit;
+        u_int32_t l, r, parent;         /* 1-based indices or 0 */
+        u_int32_t family;               /* 4, 6, or 0 for glue nodes */
+        u_int32_t bitlen;
+        u_char addr[16];
+} radix_snap_node_t;
+
+size_t
+radix_snapshot_size(radix_tree_t *radix)
+{
+        return (sizeof(radix_snap_hdr_t) +
+            (size_t)radix->num_active_node * sizeof(radix_snap_node_t));
+}
+
+int
+radix_snapshot_write(radix_tree_t *radix, u_char *buf, size_t len)
+{
+        radix_snap_hdr_t *hdr;
+        radix_snap_node_t *recs, *rec;
+        radix_node_t **order, *node;
+        size_t n, i;
+
+        if (len < radix_snapshot_size(radix))
+                return (-1);
+
+        hdr = (radix_snap_hdr_t *)buf;
+        recs = (radix_snap_node_t *)(hdr + 1);
+        memset(buf, '\0', radix_snapshot_size(radix));
+        memcpy(hdr->magic, RADIX_SNAP_MAGIC, 4);
+        hdr->version = RADIX_SNAP_VERSION;
+        hdr->count = radix->num_active_node;
+        hdr->head4 = hdr->head6 = 0;
+
+        if (radix->num_active_node <= 0)
+                return (0);
+        if ((order = PyMem_RawMalloc(radix->num_active_node *
+            sizeof(*order))) == NULL)
+                return (-1);
+
+        n = 0;
+        if (radix->head_ipv4 != NULL) {
+                order[n++] = radix->head_ipv4;
+                hdr->head4 = n;
+        }
+        if (radix->head_ipv6 != NULL) {
+                order[n++] = radix->head_ipv6;
+                hdr->head6 = n;
+        }
+        for (i = 0; i < n; i++) {
+                node = order[i];
+                rec = &recs[i];
+                rec->bit = node->bit;
+                if (node->prefix != NULL) {
+                        rec->family =
+                            node->prefix->family == AF_INET ? 4 : 6;
+                        rec->bitlen = node->prefix->bitlen;
+                        memcpy(rec->addr, prefix_touchar(node->prefix),
+                            rec->family == 4 ? 4 : 16);
+                }
+                if (node->l != NULL) {
+                        order[n] = node->l;
+                        rec->l = ++n;
+                        recs[n - 1].parent = i + 1;
+                }
+                if (node->r != NULL) {
+                        order[n] = node->r;
+                        rec->r = ++n;
+                        recs[n - 1].parent = i + 1;
+                }
+        }
+        PyMem_RawFree(order);
+        return (0);
+}
+
+/*
+ * Rebuild a tree (which must be empty) from a snapshot buffer. If
+ * func is supplied it is called as func(node, cbctx) for every loaded
+ * node carrying a prefix; a non-zero return aborts the load.
+ * Returns 0 on success, -1 on a malformed snapshot, -2 on memory
+ * exhaustion or a callback failure.
+ */
+int
+radix_snapshot_load(radix_tree_t *radix, const u_char *buf, size_t len,
+    rdx_search_cb_t func, void *cbctx)
+{
+        const radix_snap_hdr_t *hdr;
+        const radix_snap_node_t *recs, *rec;
+        radix_node_t *newnodes;
+        prefix_t *newprefixes;
+        radix_pool_block_t *nblock, *pblock;
+        size_t n, i, npfx, j;
+
+        if (radix->num_active_node != 0)
+                return (-1);
+        if (len < sizeof(*hdr))
+                return (-1);
+        hdr = (const radix_snap_hdr_t *)buf;
+        if (memcmp(hdr->magic, RADIX_SNAP_MAGIC, 4) != 0 ||
+            hdr->version != RADIX_SNAP_VERSION)
+                return (-1);
+        n = hdr->count;
+        if (len != sizeof(*hdr) + n * sizeof(*recs) ||
+            hdr->head4 > n || hdr->head6 > n)
+                return (-1);
+        if (n == 0)
+                return (0);
+        recs = (const radix_snap_node_t *)(hdr + 1);
+
+        npfx = 0;
+        for (i = 0; i < n; i++) {
+                rec = &recs[i];
+                if (rec->l > n || rec->r > n || rec->parent > n ||
+                    rec->bit > RADIX_MAXBITS)
+                        return (-1);
+                /*
+                 * BFS order means children always come after their
+                 * parent; a self or back link would build a cyclic
+                 * tree that never terminates a search.
+                 */
+                if ((rec->l != 0 && rec->l <= i + 1) ||
+                    (rec->r != 0 && rec->r <= i + 1))
+                        return (-1);
+                if (rec->family == 4) {
+                        if (rec->bitlen > 32)
+                                return (-1);
+                        npfx++;
+                } else if (rec->family == 6) {
+                        if (rec->bitlen > 128)
+                                return (-1);
+                        npfx++;
+                } else if (rec->family != 0)
+                        return (-1);
+        }
+
+        nblock = PyMem_RawMalloc(sizeof(*nblock) + n * sizeof(radix_node_t));
+        pblock = npfx == 0 ? NULL :
+            PyMem_RawMalloc(sizeof(*pblock) + npfx * sizeof(prefix_t));
+        if (nblock == NULL || (npfx != 0 && pblock == NULL)) {
+                PyMem_RawFree(nblock);
+                PyMem_RawFree(pblock);
+                return (-2);
+        }
+        newnodes = (radix_node_t *)(nblock + 1);
+        newprefixes = pblock == NULL ? NULL : (prefix_t *)(pblock + 1);
+
+        for (i = 0, j = 0; i < n; i++) {
+                rec = &recs[i];
+                newnodes[i].bit = rec->bit;
+                newnodes[i].l = rec->l ? &newnodes[rec->l - 1] : NULL;
+                newnodes[i].r = rec->r ? &newnodes[rec->r - 1] : NULL;
+                newnodes[i].parent =
+                    rec->parent ? &newnodes[rec->parent - 1] : NULL;
+                newnodes[i].data = NULL;
+                if (rec->family != 0) {
+                        memset(&newprefixes[j], '\0',
+                            sizeof(newprefixes[j]));
+                        newprefixes[j].family =
+                            rec->family == 4 ? AF_INET : AF_INET6;
+                        newprefixes[j].bitlen = rec->bitlen;
+                        newprefixes[j].ref_count = 1;
+                        memcpy(&newprefixes[j].add, rec->addr,
+                            rec->family == 4 ? 4 : 16);
+                        newnodes[i].prefix = &newprefixes[j++];
+                } else
+                        newnodes[i].prefix = NULL;
+        }
+
+        radix->head_ipv4 = hdr->head4 ? &newnodes[hdr->head4 - 1] : NULL;
+        radix->head_ipv6 = hdr->head6 ? &newnodes[hdr->head6 - 1] : NULL;
+        radix->num_active_node = n;
+        radix->num_prefixes = npfx;
+
+        /* empty trees may still hold drained slabs */
+        radix_pool_reset(&radix->node_pool);
+        radix_pool_reset(&radix->prefix_pool);
+
+        nblock->next = NULL;
+        radix->node_pool.blocks = nblock;
+        radix->node_pool.freelist = NULL;
+        radix->node_pool.brk = (u_char *)(newnodes + n);
+        radix->node_pool.end = radix->node_pool.brk;
+        radix->node_pool.allocated = sizeof(*nblock) +
+            n * sizeof(radix_node_t);
+        if (pblock != NULL)
+                pblock->next = NULL;
+        radix->prefix_pool.blocks = pblock;
+        radix->prefix_pool.freelist = NULL;
+        radix->prefix_pool.brk = pblock == NULL ? NULL :
+            (u_char *)(newprefixes + npfx);
+        radix->prefix_pool.end = radix->prefix_pool.brk;
+        radix->prefix_pool.allocated = pblock == NULL ? 0 :
+            sizeof(*pblock) + npfx * sizeof(prefix_t);
+
+        if (func != NULL) {
+                for (i = 0; i < n; i++) {
+                        if (newnodes[i].prefix != NULL &&
+                            func(&newnodes[i], cbctx) != 0)
+                                return (-2);
+                }
+        }
+        return (0);
+}
+
+/*
+ * Check that a buffer holds a well-formed snapshot that is safe to
+ * search in place: all record links must stay in bounds and point
+ * forward (children were written after their parent, so index order
+ * is a topological order and any walk terminates). Trailing bytes
+ * beyond the last record are permitted, since shared-memory segments
+ * round their size up to a page. On success, the number of prefix-
+ * carrying records is stored in *nprefixes. Returns 0 or -1.
+ */
+int
+radix_snapshot_valid(const u_char *buf, size_t len, u_int32_t *nprefixes)
+{
+        const radix_snap_hdr_t *hdr;
+        const radix_snap_node_t *recs, *rec;
+        u_int32_t npfx;
+        size_t n, i;
+
+        if (len < sizeof(*hdr))
+                return (-1);
+        hdr = (const radix_snap_hdr_t *)buf;
+        if (memcmp(hdr->magic, RADIX_SNAP_MAGIC, 4) != 0 ||
+            hdr->version != RADIX_SNAP_VERSION)
+                return (-1);
+        n = hdr->count;
+        if (len < sizeof(*hdr) + n * sizeof(*recs) ||
+            hdr->head4 > n || hdr->head6 > n)
+                return (-1);
+        recs = (const radix_snap_node_t *)(hdr + 1);
+
+        npfx = 0;
+        for (i = 0; i < n; i++) {
+                rec = &recs[i];
+                if (rec->l > n || rec->r > n || rec->parent > n ||
+                    rec->bit > RADIX_MAXBITS)
+                        return (-1);
+                if ((rec->l != 0 && rec->l <= i + 1) ||
+                    (rec->r != 0 && rec->r <= i + 1))
+                        return (-1);
+                if (rec->family == 4) {
+                        if (rec->bitlen > 32)
+                                return (-1);
+                        npfx++;
+                } else if (rec->family == 6) {
+                        if (rec->bitlen > 128)
+                                return (-1);
+                        npfx++;
+                } else if (rec->family != 0)
+                        return (-1);
+        }
+        if (nprefixes != NULL)
+                *nprefixes = npfx;
+        return (0);
+}
+
+/*
+ * Longest-match search directly over a snapshot buffer, walking the
+ * record array by index without rebuilding a tree. The buffer is
+ * never written and carries no pointers, so it may live in read-only
+ * shared memory mapped by many processes at once; it must have been
+ * checked with radix_snapshot_valid() first. On a match the winning
+ * prefix is copied into *result and 1 is returned, otherwise 0.
+ */
+int
+radix_snapshot_search_best(const u_char *buf, prefix_t *prefix,
+    prefix_t *result)
+{
+        const radix_snap_hdr_t *hdr = (const radix_snap_hdr_t *)buf;
+        const radix_snap_node_t *recs, *rec, *best = NULL;
+        u_char *addr = prefix_touchar(prefix);
+        u_int bitlen = prefix->bitlen, confirmed = 0;
+        u_int32_t idx;
+
+        recs = (const radix_snap_node_t *)(hdr + 1);
+        idx = prefix->family == AF_INET ? hdr->head4 : hdr->head6;
+
+        /* same single-pass confirmation as radix_search_best2 */
+        while (idx != 0) {
+                rec = &recs[idx - 1];
+                if (rec->bit > bitlen)
+                        break;
+                if (rec->family != 0 && rec->bitlen <= bitlen) {
+                        if (!comp_with_mask_from((u_char *)rec->addr,
+                            addr, rec->bitlen, confirmed))
+                                break;
+                        best = rec;
+                        confirmed = rec->bitlen;
+                }
+                idx = BIT_TEST_SEARCH_BIT(addr, rec->bit) ?
+                    rec->r : rec->l;
+        }
+        if (best == NULL)
+                return (0);
+
+        memset(result, '\0', sizeof(*result));
+        result->family = best->family == 4 ? AF_INET : AF_INET6;
+        result->bitlen = best->bitlen;
+        result->ref_count = 1;
+        memcpy(&result->add, best->addr, best->family == 4 ? 4 : 16);
+        return (1);
+}
+
+/*
+ * Repack the tree into freshly-allocated, exactly-sized slabs with the
+ * nodes in BFS order and the prefixes alongside, releasing the old pool
+ * blocks. Read-heavy workloads touch far fewer cache lines afterwards.
+ * If func is supplied it is called as func(node, cbctx) for every
+ * relocated node carrying data, so the caller can fix up back-pointers.
+ */
+int
+radix_compact(radix_tree_t *radix, rdx_cb_t func, void *cbctx)
+{
+        radix_node_t **order, *newnodes;
+        prefix_t *newprefixes;
+        radix_pool_block_t *nblock, *pblock, *block, *next;
+        size_t n, i, j, npfx;
+
+        /* relocation would leave stale pointers in the stride table */
+        radix_free_direct(radix);
+
+        if (radix->num_active_node <= 0)
+                return (0);
+
+        /* Enumerate every node, breadth-first, both families */
+        if ((order = PyMem_RawMalloc(radix->num_active_node *
+            sizeof(*order))) == NULL)
+                return (-1);
+        n = 0;
+        if (radix->head_ipv4 != NULL)
+                order[n++] = radix->head_ipv4;
+        if (radix->head_ipv6 != NULL)
+                order[n++] = radix->head_ipv6;
+        for (i = 0; i < n; i++) {
+                if (order[i]->l != NULL)
+                        order[n++] = order[i]->l;
+                if (order[i]->r != NULL)
+                        order[n++] = order[i]->r;
+        }
+        npfx = 0;
+        for (i = 0; i < n; i++) {
+                if (order[i]->prefix != NULL)
+                        npfx++;
+        }
+
+        nblock = PyMem_RawMalloc(sizeof(*nblock) + n * sizeof(radix_node_t));
+        pblock = npfx == 0 ? NULL :
+            PyMem_RawMalloc(sizeof(*pblock) + npfx * sizeof(prefix_t));
+        if (nblock == NULL || (npfx != 0 && pblock == NULL)) {
+                PyMem_RawFree(nblock);
+                PyMem_RawFree(pblock);
+                PyMem_RawFree(order);
+                return (-1);
+        }
+        newnodes = (radix_node_t *)(nblock + 1);
+        newprefixes = pblock == NULL ? NULL : (prefix_t *)(pblock + 1);
+
+        /*
+         * Copy the nodes, then overload each old node's parent field as
+         * a forwarding pointer so the copied l/r/parent links and the
+         * tree heads can be redirected in place.
+         */
+        for (i = 0; i < n; i++)
+                newnodes[i] = *order[i];
+        for (i = 0; i < n; i++)
+                order[i]->parent = &newnodes[i];
+        for (i = 0, j = 0; i < n; i++) {
+                if (newnodes[i].l != NULL)
+                        newnodes[i].l = newnodes[i].l->parent;
+                if (newnodes[i].r != NULL)
+                        newnodes[i].r = newnodes[i].r->parent;
+                if (newnodes[i].parent != NULL)
+                        newnodes[i].parent = newnodes[i].parent->parent;
+                if (newnodes[i].prefix != NULL) {
+                        newprefixes[j] = *newnodes[i].prefix;
+                        newnodes[i].prefix = &newprefixes[j++];
+                }
+                if (newnodes[i].data != NULL && func != NULL)
+                        func(&newnodes[i], cbctx);
+        }
+        if (radix->head_ipv4 != NULL)
+                radix->head_ipv4 = radix->head_ipv4->parent;
+        if (radix->head_ipv6 != NULL)
+                radix->head_ipv6 = radix->head_ipv6->parent;
+        PyMem_RawFree(order);
+
+        /* Swap the compacted slabs in as the pools' only blocks */
+        for (block = radix->node_pool.blocks; block != NULL; block = next) {
+                next = block->next;
+                PyMem_RawFree(block);
+        }
+        for (block = radix->prefix_pool.blocks; block != NULL; block = next) {
+                next = block->next;
+                PyMem_RawFree(block);
+        }
+        nblock->next = NULL;
+        radix->node_pool.blocks = nblock;
+        radix->node_pool.freelist = NULL;
+        radix->node_pool.brk = (u_char *)(newnodes + n);
+        radix->node_pool.end = radix->node_pool.brk;
+        radix->node_pool.allocated = sizeof(*nblock) +
+            n * sizeof(radix_node_t);
+        if (pblock != NULL)
+                pblock->next = NULL;
+        radix->prefix_pool.blocks = pblock;
+        radix->prefix_pool.freelist = NULL;
+        radix->prefix_pool.brk = pblock == NULL ? NULL :
+            (u_char *)(newprefixes + npfx);
+        radix->prefix_pool.end = radix->prefix_pool.brk;
+        radix->prefix_pool.allocated = pblock == NULL ? 0 :
+            sizeof(*pblock) + npfx * sizeof(prefix_t);
+
+        return (0);
+}
+
 /*
  * if func is supplied, it will be called as func(node->data)
  * before deleting the node
@@ -219,12 +824,15 @@ radix_clear_head(radix_tree_t *radix, radix_node_t *head, rdx_cb_t func, void *c
                         radix_node_t *l = Xrn->l;
                         radix_node_t *r = Xrn->r;
 
+                        /*
+                         * nodes and prefixes live in the tree's pools;
+                         * the caller releases them wholesale, so only
+                         * the data callback runs per node here
+                         */
                         if (Xrn->prefix) {
-                                Deref_Prefix(Xrn->prefix);
                                 if (Xrn->data && func)
                                         func(Xrn, cbctx);
                         }
-                        PyMem_Free(Xrn);
                         radix->num_active_node--;
 
                         if (l) {
@@ -247,13 +855,196 @@ Clear_Radix(radix_tree_t *radix, rdx_cb_t func, void *cbctx)
 {
         radix_clear_head(radix, radix->head_ipv4, func, cbctx);
         radix_clear_head(radix, radix->head_ipv6, func, cbctx);
+        radix->head_ipv4 = NULL;
+        radix->head_ipv6 = NULL;
+        radix->num_prefixes = 0;
+        radix_free_direct(radix);
+        radix_pool_reset(&radix->node_pool);
+        radix_pool_reset(&radix->prefix_pool);
 }
 
 void
 Destroy_Radix(radix_tree_t *radix, rdx_cb_t func, void *cbctx)
 {
         Clear_Radix(radix, func, cbctx);
-        PyMem_Free(radix);
+        PyMem_RawFree(radix);
+}
+
+/*
+ * Parallel-build support. Worker threads populate private trees, each
+ * owning a disjoint set of top-byte partitions: every prefix of
+ * length >= RADIX_GRAFT_BITS whose first address byte belongs to the
+ * worker goes into its tree. radix_graft_merge() then adopts the
+ * workers' slabs wholesale and links their partition subtries under a
+ * fresh set of glue nodes in the destination, so the merge copies no
+ * nodes and its cost is proportional to the number of partitions, not
+ * prefixes. Shorter prefixes must be inserted by the caller afterwards
+ * through the normal radix_lookup() path.
+ */
+
+/* move every slab and free entry of 'src' into 'dst' */
+static void
+radix_pool_adopt(radix_pool_t *dst, radix_pool_t *src)
+{
+        radix_pool_block_t *block;
+        void *p;
+
+        /* unfilled bump space in the newest slab becomes free entries */
+        while (src->brk != NULL && src->brk + src->size <= src->end) {
+                radix_pool_put(src, src->brk);
+                src->brk += src->size;
+        }
+        while ((p = src->freelist) != NULL) {
+                src->freelist = *(void **)p;
+                radix_pool_put(dst, p);
+        }
+        while ((block = src->blocks) != NULL) {
+                src->blocks = block->next;
+                block->next = dst->blocks;
+                dst->blocks = block;
+        }
+        dst->allocated += src->allocated;
+        radix_pool_init(src, src->size);
+}
+
+/*
+ * Collect the partition subtrie heads of one family of a worker tree:
+ * the maximal nodes with bit >= RADIX_GRAFT_BITS, each covering
+ * exactly one top-byte partition. Glue nodes above them only branch
+ * between partitions and are returned to the worker's pool. Records
+ * the partition byte of each head in vals[].
+ */
+static int
+radix_graft_heads(radix_tree_t *src, radix_node_t *node,
+    radix_node_t **heads, u_char *vals, int *n)
+{
+        radix_node_t *down;
+
+        if (node == NULL)
+                return (0);
+        if (node->bit >= RADIX_GRAFT_BITS) {
+                if (*n >= 1 << RADIX_GRAFT_BITS)
+                        return (-1);
+                /* the whole subtree shares its top byte; fish it out */
+                for (down = node; down->prefix == NULL; )
+                        down = (down->l != NULL) ? down->l : down->r;
+                vals[*n] = *(u_char *)&down->prefix->add;
+                heads[*n] = node;
+                (*n)++;
+                node->parent = NULL;
+                return (0);
+        }
+        if (radix_graft_heads(src, node->l, heads, vals, n) == -1 ||
+            radix_graft_heads(src, node->r, heads, vals, n) == -1)
+                return (-1);
+        radix_pool_put(&src->node_pool, node);
+        src->num_active_node--;
+        return (0);
+}
+
+/* paired insertion sort; at most 2^RADIX_GRAFT_BITS entries */
+static void
+radix_graft_sort(radix_node_t **heads, u_char *vals, int n)
+{
+        radix_node_t *h;
+        u_char v;
+        int i, j;
+
+        for (i = 1; i < n; i++) {
+                v = vals[i];
+                h = heads[i];
+                for (j = i - 1; j >= 0 && vals[j] > v; j--) {
+                        vals[j + 1] = vals[j];
+                        heads[j + 1] = heads[j];
+                }
+                vals[j + 1] = v;
+                heads[j + 1] = h;
+        }
+}
+
+/*
+ * Link the sorted partition heads into one patricia subtree, creating
+ * a glue branch node at every bit position (all below RADIX_GRAFT_BITS)
+ * where the partition bytes diverge. Path compression falls out of
+ * the recursion: a bit where every byte in the range agrees creates
+ * no node.
+ */
+static radix_node_t *
+radix_graft_span(radix_tree_t *dst, radix_node_t **heads, u_char *vals,
+    int lo, int hi, u_int bit)
+{
+        radix_node_t *glue;
+        int mid;
+
+        if (lo == hi)
+                return (heads[lo]);
+        while (((vals[lo] ^ vals[hi]) & (0x80 >> bit)) == 0)
+                bit++;
+        for (mid = lo + 1; mid <= hi; mid++)
+                if (vals[mid] & (0x80 >> bit))
+                        break;
+        if ((glue = radix_pool_get(&dst->node_pool)) == NULL)
+                return (NULL);
+        glue->bit = bit;
+        glue->prefix = NULL;
+        glue->data = NULL;
+        glue->parent = NULL;
+        dst->num_active_node++;
+        if ((glue->l = radix_graft_span(dst, heads, vals, lo, mid - 1,
+            bit + 1)) == NULL ||
+            (glue->r = radix_graft_span(dst, heads, vals, mid, hi,
+            bit + 1)) == NULL)
+                return (NULL);
+        glue->l->parent = glue;
+        glue->r->parent = glue;
+        return (glue);
+}
+
+/*
+ * Merge worker-built trees into the empty tree 'dst'. Every prefix in
+ * the sources must be at least RADIX_GRAFT_BITS long and no top-byte
+ * partition (per family) may appear in more than one source. The
+ * sources are consumed: their slabs become dst's and their structs are
+ * freed. On failure dst may hold adopted slabs and must be cleared or
+ * destroyed by the caller; sources already consumed are NULLed out.
+ */
+int
+radix_graft_merge(radix_tree_t *dst, radix_tree_t **srcs, int nsrc)
+{
+        radix_node_t *heads4[1 << RADIX_GRAFT_BITS];
+        radix_node_t *heads6[1 << RADIX_GRAFT_BITS];
+        u_char vals4[1 << RADIX_GRAFT_BITS], vals6[1 << RADIX_GRAFT_BITS];
+        radix_tree_t *src;
+        int i, n4 = 0, n6 = 0;
+
+        if (dst->head_ipv4 != NULL || dst->head_ipv6 != NULL)
+                return (-1);
+        for (i = 0; i < nsrc; i++) {
+                src = srcs[i];
+                if (radix_graft_heads(src, src->head_ipv4, heads4, vals4,
+                    &n4) == -1 ||
+                    radix_graft_heads(src, src->head_ipv6, heads6, vals6,
+                    &n6) == -1)
+                        return (-1);
+                radix_pool_adopt(&dst->node_pool, &src->node_pool);
+                radix_pool_adopt(&dst->prefix_pool, &src->prefix_pool);
+                dst->num_active_node += src->num_active_node;
+                dst->num_prefixes += src->num_prefixes;
+                dst->num_inserts += src->num_inserts;
+                dst->num_removes += src->num_removes;
+                dst->num_lookups += src->num_lookups;
+                PyMem_RawFree(src);
+                srcs[i] = NULL;
+        }
+        radix_graft_sort(heads4, vals4, n4);
+        radix_graft_sort(heads6, vals6, n6);
+        if (n4 > 0 && (dst->head_ipv4 = radix_graft_span(dst, heads4,
+            vals4, 0, n4 - 1, 0)) == NULL)
+                return (-1);
+        if (n6 > 0 && (dst->head_ipv6 = radix_graft_span(dst, heads6,
+            vals6, 0, n6 - 1, 0)) == NULL)
+                return (-1);
+        return (0);
 }
 
 /*
@@ -357,36 +1148,79 @@ radix_node_t
 }
 
 
+/*
+ * Stride-table fast path: resolve the first RADIX_DIRECT_BITS levels
+ * with one table load, then walk only the deeper part of the trie.
+ * Only valid for inclusive searches of at least RADIX_DIRECT_BITS.
+ */
+static radix_node_t
+*radix_search_best_direct(radix_tree_t *radix, prefix_t *prefix)
+{
+        radix_node_t *node, *best = NULL;
+        radix_direct_t *entry;
+        u_char *addr;
+        u_int bitlen, confirmed = 0;
+
+        addr = prefix_touchar(prefix);
+        bitlen = prefix->bitlen;
+        entry = &radix->direct_ipv4[((u_int)addr[0] << 8) | addr[1]];
+
+        for (node = entry->start;
+            node != NULL && node->bit <= bitlen;
+            node = BIT_TEST_SEARCH(addr, node) ? node->r : node->l) {
+                if (node->prefix == NULL)
+                        continue;
+                /*
+                 * A mismatch also rules out everything deeper: the
+                 * subtree below this node shares its prefix bits.
+                 */
+                if (!comp_with_mask_from(prefix_touchar(node->prefix),
+                    addr, node->prefix->bitlen, confirmed))
+                        break;
+                best = node;
+                confirmed = node->prefix->bitlen;
+        }
+        if (best != NULL)
+                return (best);
+        /* no deeper match; the table knows the best short prefix */
+        return (entry->best);
+}
+
 /* if inclusive != 0, "best" may be the given prefix itself */
 radix_node_t
 *radix_search_best2(radix_tree_t *radix, prefix_t *prefix, int inclusive)
 {
-        radix_node_t *node, *head;
-        radix_node_t *stack[RADIX_MAXBITS + 1];
-        u_int bitlen;
-        int cnt = 0;
+        radix_node_t *node, *head, *best = NULL;
+        u_int bitlen, confirmed = 0;
 
+        radix->num_lookups++;
         if ((head = RADIX_HEAD_BY_PREFIX(radix, prefix)) == NULL)
                 return (NULL);
 
         bitlen = prefix->bitlen;
 
-        RADIX_SEARCH_FOREACH_INCLUSIVE(node, head, prefix) {
-                if (node->prefix && (inclusive || node->bit != bitlen))
-                    stack[cnt++] = node;
-        }
+        if (radix->direct_ipv4 != NULL && inclusive &&
+            prefix->family == AF_INET && bitlen >= RADIX_DIRECT_BITS)
+                return (radix_search_best_direct(radix, prefix));
 
-        if (cnt <= 0)
-                return (NULL);
-
-        while (--cnt >= 0) {
-                node = stack[cnt];
-                if (comp_with_mask(prefix_touchar(node->prefix),
-                    prefix_touchar(prefix), node->prefix->bitlen) &&
-                    node->prefix->bitlen <= bitlen)
-                        return (node);
+        /*
+         * Single pass: verify each prefixed node as it is passed,
+         * keeping the deepest confirmed match. Candidates are nested,
+         * so only the bits beyond the last confirmed ancestor need
+         * comparing, and a mismatch rules out the whole subtree below.
+         */
+        RADIX_SEARCH_FOREACH_INCLUSIVE(node, head, prefix) {
+                if (node->prefix == NULL ||
+                    (!inclusive && node->bit == bitlen))
+                        continue;
+                if (!comp_with_mask_from(prefix_touchar(node->prefix),
+                    prefix_touchar(prefix), node->prefix->bitlen,
+                    confirmed))
+                        break;
+                best = node;
+                confirmed = node->prefix->bitlen;
         }
-        return (NULL);
+        return (best);
 }
 
 
@@ -550,6 +1384,34 @@ radix_search_covered(radix_tree_t *radix, prefix_t *prefix, rdx_search_cb_t func
         return (0);
 }
 
+/*
+ * Returns the node whose subtree holds every prefix covered by
+ * 'prefix' (the first node at or below prefix->bitlen on the search
+ * path), or NULL when the tree has no such branch. The subtree may
+ * still contain foreign prefixes; callers filter with
+ * prefix_covered().
+ */
+radix_node_t
+*radix_subtree(radix_tree_t *radix, prefix_t *prefix)
+{
+        radix_node_t *node, *head;
+
+        if ((head = RADIX_HEAD_BY_PREFIX(radix, prefix)) == NULL)
+                return (NULL);
+        RADIX_SEARCH_FOREACH(node, head, prefix);
+        return (node);
+}
+
+int
+prefix_covered(prefix_t *prefix, prefix_t *within)
+{
+        if (prefix->family != within->family ||
+            prefix->bitlen < within->bitlen)
+                return (0);
+        return (comp_with_mask(prefix_touchar(prefix),
+            prefix_touchar(within), within->bitlen));
+}
+
 int
 radix_search_intersect(radix_tree_t *radix, prefix_t *prefix, rdx_search_cb_t func, void *cbctx)
 {
@@ -567,21 +1429,24 @@ radix_node_t
         radix_node_t **phead, *node, *new_node, *parent, *glue;
         u_char *addr, *test_addr;
         u_int bitlen, check_bit, differ_bit, maxbits;
-        u_int i, j, r;
+        u_int32_t wa, wb, r;
+        u_int i;
 
+        radix->num_inserts++;
         maxbits = RADIX_MAXBITS_BY_PREFIX(prefix);
         phead = RADIX_PHEAD_BY_PREFIX(radix, prefix);
         if (*phead == NULL) {
-                if ((node = PyMem_Malloc(sizeof(*node))) == NULL)
+                if ((node = radix_pool_get(&radix->node_pool)) == NULL)
                         return (NULL);
                 memset(node, '\0', sizeof(*node));
                 node->bit = prefix->bitlen;
-                node->prefix = Ref_Prefix(prefix);
+                node->prefix = radix_prefix_dup(radix, prefix);
                 node->parent = NULL;
                 node->l = node->r = NULL;
                 node->data = NULL;
                 *phead = node;
                 radix->num_active_node++;
+                radix->num_prefixes++;
                 return (node);
         }
         addr = prefix_touchar(prefix);
@@ -601,21 +1466,21 @@ radix_node_t
         }
 
         test_addr = prefix_touchar(node->prefix);
-        /* find the first bit different */
+        /*
+         * Find the first bit different, one 32-bit word at a time;
+         * both addresses live in 16-byte prefix_t unions so the word
+         * loads are always in bounds.
+         */
         check_bit = (node->bit < bitlen) ? node->bit : bitlen;
         differ_bit = 0;
-        for (i = 0; i * 8 < check_bit; i++) {
-                if ((r = (addr[i] ^ test_addr[i])) == 0) {
-                        differ_bit = (i + 1) * 8;
+        for (i = 0; i * 8 < check_bit; i += 4) {
+                memcpy(&wa, addr + i, 4);
+                memcpy(&wb, test_addr + i, 4);
+                if ((r = ntohl(wa ^ wb)) == 0) {
+                        differ_bit = (i + 4) * 8;
                         continue;
                 }
-                /* I know the better way, but for now */
-                for (j = 0; j < 8; j++) {
-                        if (BIT_TEST(r, (0x80 >> j)))
-                                break;
-                }
-                /* must be found */
-                differ_bit = i * 8 + j;
+                differ_bit = i * 8 + radix_clz32(r);
                 break;
         }
         if (differ_bit > check_bit)
@@ -628,19 +1493,22 @@ radix_node_t
         }
 
         if (differ_bit == bitlen && node->bit == bitlen) {
-                if (node->prefix == NULL)
-                        node->prefix = Ref_Prefix(prefix);
+                if (node->prefix == NULL) {
+                        node->prefix = radix_prefix_dup(radix, prefix);
+                        radix->num_prefixes++;
+                }
                 return (node);
         }
-        if ((new_node = PyMem_Malloc(sizeof(*new_node))) == NULL)
+        if ((new_node = radix_pool_get(&radix->node_pool)) == NULL)
                 return (NULL);
         memset(new_node, '\0', sizeof(*new_node));
         new_node->bit = prefix->bitlen;
-        new_node->prefix = Ref_Prefix(prefix);
+        new_node->prefix = radix_prefix_dup(radix, prefix);
         new_node->parent = NULL;
         new_node->l = new_node->r = NULL;
         new_node->data = NULL;
         radix->num_active_node++;
+        radix->num_prefixes++;
 
         if (node->bit == differ_bit) {
                 new_node->parent = node;
@@ -668,8 +1536,15 @@ radix_node_t
 
                 node->parent = new_node;
         } else {
-                if ((glue = PyMem_Malloc(sizeof(*glue))) == NULL)
+                if ((glue = radix_pool_get(&radix->node_pool)) == NULL) {
+                        if (new_node->prefix != NULL)
+                                radix_pool_put(&radix->prefix_pool,
+                                    new_node->prefix);
+                        radix_pool_put(&radix->node_pool, new_node);
+                        radix->num_active_node--;
+                        radix->num_prefixes--;
                         return (NULL);
+                }
                 memset(glue, '\0', sizeof(*glue));
                 glue->bit = differ_bit;
                 glue->prefix = NULL;
@@ -704,6 +1579,7 @@ radix_remove(radix_tree_t *radix, radix_node_t *node)
 {
         radix_node_t **phead, *parent, *child;
 
+        radix->num_removes++;
         phead = RADIX_PHEAD_BY_PREFIX(radix, node->prefix);
 
         if (node->r && node->l) {
@@ -711,8 +1587,10 @@ radix_remove(radix_tree_t *radix, radix_node_t *node)
                  * this might be a placeholder node -- have to check and make
                  * sure there is a prefix aossciated with it !
                  */
-                if (node->prefix != NULL)
-                        Deref_Prefix(node->prefix);
+                if (node->prefix != NULL) {
+                        radix_pool_put(&radix->prefix_pool, node->prefix);
+                        radix->num_prefixes--;
+                }
                 node->prefix = NULL;
                 /* Also I needed to clear data pointer -- masaki */
                 node->data = NULL;
@@ -720,8 +1598,11 @@ radix_remove(radix_tree_t *radix, radix_node_t *node)
         }
         if (node->r == NULL && node->l == NULL) {
                 parent = node->parent;
-                Deref_Prefix(node->prefix);
-                PyMem_Free(node);
+                if (node->prefix != NULL) {
+                        radix_pool_put(&radix->prefix_pool, node->prefix);
+                        radix->num_prefixes--;
+                }
+                radix_pool_put(&radix->node_pool, node);
                 radix->num_active_node--;
 
                 if (parent == NULL) {
@@ -748,7 +1629,7 @@ radix_remove(radix_tree_t *radix, radix_node_t *node)
                         parent->parent->l = child;
 
                 child->parent = parent->parent;
-                PyMem_Free(parent);
+                radix_pool_put(&radix->node_pool, parent);
                 radix->num_active_node--;
                 return;
         }
@@ -760,8 +1641,11 @@ radix_remove(radix_tree_t *radix, radix_node_t *node)
         parent = node->parent;
         child->parent = parent;
 
-        Deref_Prefix(node->prefix);
-        PyMem_Free(node);
+        if (node->prefix != NULL) {
+                radix_pool_put(&radix->prefix_pool, node->prefix);
+                radix->num_prefixes--;
+        }
+        radix_pool_put(&radix->node_pool, node);
         radix->num_active_node--;
 
         if (parent == NULL) {
@@ -789,11 +1673,114 @@ sanitise_mask(u_char *addr, u_int masklen, u_int maskbits)
                 addr[i] = 0;
 }
 
+/*
+ * Strict dotted-quad parser. Leading zeros are rejected so that octal
+ * forms like "010.0.0.1" keep their historical inet_aton() meaning via
+ * the getaddrinfo() fallback.
+ */
+static int
+parse_ipv4_fast(const char *s, u_char *addr)
+{
+        u_int octet;
+        int i;
+
+        for (i = 0; i < 4; i++) {
+                if (*s < '0' || *s > '9')
+                        return (-1);
+                if (*s == '0' && s[1] >= '0' && s[1] <= '9')
+                        return (-1);
+                octet = 0;
+                do {
+                        octet = octet * 10 + (*s++ - '0');
+                        if (octet > 255)
+                                return (-1);
+                } while (*s >= '0' && *s <= '9');
+                addr[i] = octet;
+                if (i < 3 && *s++ != '.')
+                        return (-1);
+        }
+        return (*s == '\0' ? 0 : -1);
+}
+
+/* RFC 4291 text forms: hex groups, "::" compression, embedded v4 tail */
+static int
+parse_ipv6_fast(const char *s, u_char *addr)
+{
+        u_char tmp[16], *tp = tmp, *endp = tmp + 16, *colonp = NULL;
+        const char *curtok;
+        u_int val = 0;
+        int ch, digit, seen_digits = 0;
+
+        if (*s == ':' && *++s != ':')
+                return (-1);
+        curtok = s;
+        while ((ch = *s++) != '\0') {
+                if (ch >= '0' && ch <= '9')
+                        digit = ch - '0';
+                else if (ch >= 'a' && ch <= 'f')
+                        digit = ch - 'a' + 10;
+                else if (ch >= 'A' && ch <= 'F')
+                        digit = ch - 'A' + 10;
+                else
+                        digit = -1;
+                if (digit != -1) {
+                        val = (val << 4) | digit;
+                        if (++seen_digits > 4)
+                                return (-1);
+                        continue;
+                }
+                if (ch == ':') {
+                        curtok = s;
+                        if (!seen_digits) {
+                                if (colonp != NULL)
+                                        return (-1);
+                                colonp = tp;
+                                continue;
+                        }
+                        if (*s == '\0' || tp + 2 > endp)
+                                return (-1);
+                        *tp++ = (u_char)(val >> 8);
+                        *tp++ = (u_char)val;
+                        seen_digits = 0;
+                        val = 0;
+                        continue;
+                }
+                if (ch == '.' && seen_digits && tp + 4 <= endp) {
+                        if (parse_ipv4_fast(curtok, tp) == -1)
+                                return (-1);
+                        tp += 4;
+                        seen_digits = 0;
+                        break;
+                }
+                return (-1);
+        }
+        if (seen_digits) {
+                if (tp + 2 > endp)
+                        return (-1);
+                *tp++ = (u_char)(val >> 8);
+                *tp++ = (u_char)val;
+        }
+        if (colonp != NULL) {
+                int n = tp - colonp;
+
+                if (tp == endp)
+                        return (-1);
+                memmove(endp - n, colonp, n);
+                memset(colonp, 0, (endp - n) - colonp);
+                tp = endp;
+        }
+        if (tp != endp)
+                return (-1);
+        memcpy(addr, tmp, 16);
+        return (0);
+}
+
 prefix_t
 *prefix_pton_ex(prefix_t *ret, const char *string, long len, const char **errmsg)
 {
         char save[256], *cp, *ep;
         struct addrinfo hints, *ai;
+        u_char fastbuf[16];
         void *addr;
         size_t slen;
         int r;
@@ -818,6 +1805,40 @@ prefix_t
                 }
                 /* More checks below */
         }
+
+        /*
+         * Fast path: the hand-rolled parsers handle the canonical text
+         * forms directly; getaddrinfo() remains as a fallback for the
+         * exotic ones (scoped addresses, octal/short quads).
+         */
+        if (strchr(save, ':') != NULL) {
+                if (parse_ipv6_fast(save, fastbuf) == 0) {
+                        if (len == -1)
+                                len = 128;
+                        else if (len < 0 || len > 128) {
+                                *errmsg = "invalid prefix length";
+                                return (NULL);
+                        }
+                        sanitise_mask(fastbuf, len, 128);
+                        ret = New_Prefix2(AF_INET6, fastbuf, len, ret);
+                        if (ret == NULL)
+                                *errmsg = "New_Prefix2 failed";
+                        return (ret);
+                }
+        } else if (parse_ipv4_fast(save, fastbuf) == 0) {
+                if (len == -1)
+                        len = 32;
+                else if (len < 0 || len > 32) {
+                        *errmsg = "invalid prefix length";
+                        return (NULL);
+                }
+                sanitise_mask(fastbuf, len, 32);
+                ret = New_Prefix2(AF_INET, fastbuf, len, ret);
+                if (ret == NULL)
+                        *errmsg = "New_Prefix2 failed";
+                return (ret);
+        }
+
         memset(&hints, '\0', sizeof(hints));
         hints.ai_flags = AI_NUMERICHOST;
 
@@ -892,7 +1913,15 @@ prefix_t
                 prefixlen = maxprefix;
         if (prefixlen < 0 || prefixlen > maxprefix)
                 return NULL;
-        return (New_Prefix2(family, blob, prefixlen, ret));
+        if ((ret = New_Prefix2(family, blob, prefixlen, ret)) != NULL) {
+                /*
+                 * Zero any host bits, as the string parsers do: the
+                 * frozen stride table and the word-wide comparisons
+                 * rely on addresses being masked to their length.
+                 */
+                sanitise_mask(prefix_touchar(ret), prefixlen, maxprefix);
+        }
+        return (ret);
 }
 
 prefix_t
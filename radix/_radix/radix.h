@@ -100,18 +100,73 @@ void Deref_Prefix(prefix_t *prefix);
  * Originally from MRT include/radix.h
  * $MRTId: radix.h,v 1.1.1.1 2000/08/14 18:46:10 labovit Exp $
  */
+/*
+ * A Patricia trie node. The trie is path-compressed by construction:
+ * 'bit' is the absolute bit index this node discriminates on and may
+ * skip any number of bits past the parent's, so chains of single-child
+ * internal nodes never exist. Prefixless glue nodes are created only
+ * as branch points with both children set (radix_remove() collapses a
+ * node the moment it drops to one child), which bounds them at one per
+ * prefixed node. Code walking the trie may rely on both invariants.
+ */
 typedef struct _radix_node_t {
-        u_int bit;                      /* flag if this node used */
-        prefix_t *prefix;               /* who we are in radix tree */
+        u_int bit;                      /* bit index to test; skips
+                                         * compressed path bits */
+        prefix_t *prefix;               /* NULL on glue nodes */
         struct _radix_node_t *l, *r;    /* left and right children */
         struct _radix_node_t *parent;   /* may be used */
         void *data;                     /* pointer to data */
 } radix_node_t;
 
+/*
+ * Slab allocator state. Nodes and prefixes are carved out of large
+ * contiguous blocks owned by the tree; deleted entries are chained
+ * on a free-list for reuse and whole blocks are released at once on
+ * Clear_Radix()/Destroy_Radix().
+ */
+typedef struct _radix_pool_block_t {
+        struct _radix_pool_block_t *next;
+} radix_pool_block_t;
+
+typedef struct _radix_pool_t {
+        radix_pool_block_t *blocks;     /* chain of allocated slabs */
+        void *freelist;                 /* chain of returned entries */
+        u_char *brk, *end;              /* bump region in newest slab */
+        size_t size;                    /* entry size */
+        size_t perblock;                /* entries in next slab */
+        size_t allocated;               /* bytes held in slabs */
+} radix_pool_t;
+
+/*
+ * Direct-index table over the top 16 bits of an IPv4 address, built
+ * for frozen trees. A best-match walk starts at 'start' (the trie
+ * node reached after the first 16 single-bit levels) and falls back
+ * to 'best' (the longest matching prefix of length <= 16) when no
+ * longer candidate matches.
+ */
+typedef struct _radix_direct_t {
+        radix_node_t *start;
+        radix_node_t *best;
+} radix_direct_t;
+
+#define RADIX_DIRECT_BITS       16
+#define RADIX_DIRECT_SIZE       (1 << RADIX_DIRECT_BITS)
+
+/* partition width for parallel builds; see radix_graft_merge() */
+#define RADIX_GRAFT_BITS        8
+
 typedef struct _radix_tree_t {
         radix_node_t *head_ipv4;
         radix_node_t *head_ipv6;
         int num_active_node;            /* for debug purpose */
+        int num_prefixes;               /* nodes carrying a prefix */
+        radix_pool_t node_pool;         /* slabs of radix_node_t */
+        radix_pool_t prefix_pool;       /* slabs of prefix_t */
+        radix_direct_t *direct_ipv4;    /* stride table, frozen trees only */
+        /* operation counters since creation */
+        unsigned long long num_inserts; /* radix_lookup() calls */
+        unsigned long long num_removes; /* radix_remove() calls */
+        unsigned long long num_lookups; /* best-match searches */
 } radix_tree_t;
 
 /* Type of callback function */
@@ -119,7 +174,18 @@ typedef void (*rdx_cb_t)(radix_node_t *, void *);
 typedef int (*rdx_search_cb_t)(radix_node_t *, void *);
 
 radix_tree_t *New_Radix(void);
+int radix_compact(radix_tree_t *radix, rdx_cb_t func, void *cbctx);
+int radix_build_direct(radix_tree_t *radix);
+void radix_free_direct(radix_tree_t *radix);
+size_t radix_snapshot_size(radix_tree_t *radix);
+int radix_snapshot_write(radix_tree_t *radix, u_char *buf, size_t len);
+int radix_snapshot_load(radix_tree_t *radix, const u_char *buf, size_t len,
+    rdx_search_cb_t func, void *cbctx);
+int radix_snapshot_valid(const u_char *buf, size_t len, u_int32_t *nprefixes);
+int radix_snapshot_search_best(const u_char *buf, prefix_t *prefix,
+    prefix_t *result);
 void Destroy_Radix(radix_tree_t *radix, rdx_cb_t func, void *cbctx);
+int radix_graft_merge(radix_tree_t *dst, radix_tree_t **srcs, int nsrc);
 void Clear_Radix(radix_tree_t *radix, rdx_cb_t func, void *cbctx);
 radix_node_t *radix_lookup(radix_tree_t *radix, prefix_t *prefix);
 void radix_remove(radix_tree_t *radix, radix_node_t *node);
@@ -132,6 +198,8 @@ radix_node_t *radix_search_worst2(radix_tree_t *radix, prefix_t *prefix, int inc
 int radix_search_covering(radix_tree_t *radix, prefix_t *prefix, rdx_search_cb_t func, void *cbctx);
 int radix_search_covered(radix_tree_t *radix, prefix_t *prefix, rdx_search_cb_t func, void *cbctx, int inclusive);
 int radix_search_intersect(radix_tree_t *radix, prefix_t *prefix, rdx_search_cb_t func, void *cbctx);
+radix_node_t *radix_subtree(radix_tree_t *radix, prefix_t *prefix);
+int prefix_covered(prefix_t *prefix, prefix_t *within);
 void radix_process(radix_tree_t *radix, rdx_cb_t func, void *cbctx);
 
 #define RADIX_MAXBITS 128
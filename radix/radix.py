@@ -1,6 +1,15 @@
 from socket import (getaddrinfo, gaierror,
                     inet_pton, inet_ntop, AF_INET, AF_INET6, SOCK_RAW,
                     AI_NUMERICHOST)
+from struct import Struct
+
+# Snapshot format shared with the C extension: a fixed header and one
+# record per node (including glue nodes) in BFS order, native-endian.
+# Links are 1-based record indices, family is 4, 6 or 0 for glue.
+_SNAP_MAGIC = b'RDXS'
+_SNAP_VERSION = 1
+_SNAP_HDR = Struct('=4sIIII')
+_SNAP_NODE = Struct('=IIIIII16s')
 
 
 class RadixPrefix(object):
@@ -93,8 +102,18 @@ class RadixPrefix(object):
             if not (0 <= masklen <= 128):
                 raise ValueError('invalid prefix length')
         else:
-            return
-        self.addr = packed
+            raise ValueError('invalid packed address format')
+        # zero any host bits, as the string path does
+        max_masklen = 32 if family == AF_INET else 128
+        addr = bytearray(packed)
+        quotient, remainder = divmod(masklen, 8)
+        if remainder != 0:
+            addr[quotient] = addr[quotient] & ((~0) << (8 - remainder))
+            quotient += 1
+        while quotient < max_masklen / 8:
+            addr[quotient] = 0
+            quotient += 1
+        self.addr = addr
         self.bitlen = masklen
         self.family = family
 
@@ -206,7 +225,7 @@ class RadixTree(object):
     def remove(self, node):
         if node.right and node.left:
             node._prefix.addr = None
-            node.data = None
+            node._data = None
             node.bitlen = 0
             return
         if node.right is None and node.left is None:
@@ -385,7 +404,9 @@ class RadixNode(object):
         self.bitlen = self._prefix.bitlen
         self.left = left
         self.right = right
-        self.data = data
+        self._data = data
+        self._value = None
+        self._mode = 'dict'
         self._cache = {}
 
     def __str__(self):
@@ -414,6 +435,64 @@ class RadixNode(object):
     def packed(self):
         return self._prefix.packed
 
+    # data and value are gated on the tree's value_mode, matching the
+    # C extension; internal code uses _data directly.
+    def __get_data(self):
+        if self._mode == 'object':
+            raise TypeError("no data dict in a value_mode='object' tree; "
+                            'use node.value')
+        return self._data
+
+    def __set_data(self, data):
+        if self._mode == 'object':
+            raise TypeError("no data dict in a value_mode='object' tree; "
+                            'use node.value')
+        self._data = data
+
+    data = property(__get_data, __set_data, None, 'user data dict')
+
+    def __get_value(self):
+        if self._mode != 'object':
+            raise TypeError("node.value requires a value_mode='object' "
+                            'tree; use node.data')
+        return self._value
+
+    def __set_value(self, value):
+        if self._mode != 'object':
+            raise TypeError("node.value requires a value_mode='object' "
+                            'tree; use node.data')
+        self._value = value
+
+    value = property(__get_value, __set_value, None,
+                     "single user value (value_mode='object' trees)")
+
+    def _collect_descendants(self, direct_only):
+        results = []
+        stack = []
+        if self.right:
+            stack.append(self.right)
+        if self.left:
+            stack.append(self.left)
+        while stack:
+            node = stack.pop()
+            if node._prefix.addr is not None and node._data is not None:
+                results.append(node)
+                if direct_only:
+                    continue
+            if node.right:
+                stack.append(node.right)
+            if node.left:
+                stack.append(node.left)
+        return results
+
+    def children(self):
+        """Direct covered descendants of this node."""
+        return self._collect_descendants(True)
+
+    def subtree(self):
+        """Every prefix covered by this node, itself excluded."""
+        return self._collect_descendants(False)
+
     def __set_parent(self, parent):
         self._parent = parent
 
@@ -424,26 +503,162 @@ class RadixNode(object):
 
 
 class Radix(object):
-    def __init__(self):
+    def __init__(self, value_mode='dict'):
+        if value_mode not in ('dict', 'object'):
+            raise ValueError("value_mode must be 'dict' or 'object'")
+        self._value_mode = value_mode
         self._tree4 = RadixTree()
         self._tree6 = RadixTree()
         self.gen_id = 0            # detection of modifiction during iteration
+        self._frozen = False
+        self._inserts = 0
+        self._deletes = 0
+        self._lookups = 0
+        self._prefix_count = 0
+        self._lpm_cache = None
+        self._lpm_cache_size = 0
+        self._cache_hits = 0
+        self._cache_misses = 0
+
+    def set_lpm_cache(self, size=8192):
+        if not 0 <= size <= 2 ** 24:
+            raise ValueError('cache size must be between 0 and 2**24')
+        self._lpm_cache = {} if size else None
+        self._lpm_cache_size = size
+        self._cache_hits = 0
+        self._cache_misses = 0
+
+    def freeze(self):
+        self._frozen = True
+
+    def unfreeze(self):
+        self._frozen = False
 
     def add(self, network=None, masklen=None, packed=None):
+        if self._frozen:
+            raise RuntimeError(
+                'Radix tree is frozen (call unfreeze() to modify)')
         prefix = RadixPrefix(network, masklen, packed)
+        self._inserts += 1
         if prefix.family == AF_INET:
             node = self._tree4.add(prefix)
         else:
             node = self._tree6.add(prefix)
-        if node.data is None:
-            node.data = {}
+        node._mode = self._value_mode
+        if node._data is None:
+            node._data = {}
+            self._prefix_count += 1
         self.gen_id += 1
         return node
 
+    def add_many(self, prefixes):
+        count = 0
+        for prefix in prefixes:
+            if isinstance(prefix, bytes):
+                self.add(packed=prefix)
+            elif isinstance(prefix, str):
+                self.add(prefix)
+            else:
+                raise TypeError('prefix must be a string or packed bytes')
+            count += 1
+        return count
+
+    def clear(self, defer=False):
+        # 'defer' only matters to the C extension, which reaps the old
+        # nodes off-thread; here the garbage collector covers it.
+        # Detach held nodes from the discarded tree (the C extension
+        # NULLs their backing rn); their data is left intact.
+        for node in list(self):
+            node._parent = None
+            node.left = None
+            node.right = None
+        self._tree4 = RadixTree()
+        self._tree6 = RadixTree()
+        self._prefix_count = 0
+        self._frozen = False
+        self._lpm_cache = {} if self._lpm_cache is not None else None
+        self.gen_id += 1
+
+    def build(self, prefixes, threads=4):
+        # API parity with the C extension; worker threads cannot help a
+        # pure-python build, so this is a plain bulk insert.
+        if not 1 <= threads <= 64:
+            raise ValueError('threads must be between 1 and 64')
+        if self._tree4.head is not None or self._tree6.head is not None:
+            raise ValueError('build requires an empty tree')
+        return self.add_many(prefixes)
+
+    def load_text(self, path, column=0, delimiter=' '):
+        if column < 0:
+            raise ValueError('column must be >= 0')
+        if len(delimiter) != 1:
+            raise ValueError('delimiter must be a single character')
+        if isinstance(path, int):
+            import os
+            fp = os.fdopen(os.dup(path), 'r')
+        else:
+            fp = open(path, 'r')
+        count = 0
+        start = self.gen_id
+        try:
+            for lineno, line in enumerate(fp, 1):
+                line = line.rstrip('\r\n')
+                if not line or line.startswith('#'):
+                    continue
+                fields = line.split(delimiter)
+                if column >= len(fields):
+                    raise ValueError('line %d: missing column' % lineno)
+                token = fields[column]
+                if not token:
+                    raise ValueError('line %d: empty field' % lineno)
+                try:
+                    self.add(token)
+                except ValueError as exc:
+                    raise ValueError('line %d: %s' % (lineno, exc))
+                count += 1
+        finally:
+            fp.close()
+            # the whole load counts as one modification
+            self.gen_id = start + 1
+        return count
+
+    def update(self, adds=None, deletes=None):
+        start = self.gen_id
+        try:
+            for prefix in (deletes or []):
+                if isinstance(prefix, bytes):
+                    self.delete(packed=prefix)
+                else:
+                    self.delete(prefix)
+            for item in (adds or []):
+                data = None
+                if isinstance(item, tuple):
+                    if len(item) != 2:
+                        raise ValueError(
+                            'add entry must be a (prefix, data) tuple')
+                    item, data = item
+                if isinstance(item, bytes):
+                    node = self.add(packed=item)
+                else:
+                    node = self.add(item)
+                if data is not None:
+                    if self._value_mode == 'object':
+                        node.value = data
+                    else:
+                        node.data.update(data)
+        finally:
+            # the whole delta counts as one modification
+            self.gen_id = start + 1
+
     def delete(self, network=None, masklen=None, packed=None):
+        if self._frozen:
+            raise RuntimeError(
+                'Radix tree is frozen (call unfreeze() to modify)')
         node = self.search_exact(network, masklen, packed)
         if not node:
             raise KeyError('match not found')
+        self._deletes += 1
+        self._prefix_count -= 1
         if node.family == AF_INET:
             self._tree4.remove(node)
         else:
@@ -456,21 +671,51 @@ class Radix(object):
             node = self._tree4.search_exact(prefix)
         else:
             node = self._tree6.search_exact(prefix)
-        if node and node.data is not None:
+        if node and node._data is not None:
             return node
         else:
             return None
 
     def search_best(self, network=None, masklen=None, packed=None):
         prefix = RadixPrefix(network, masklen, packed)
+        self._lookups += 1
+        if self._lpm_cache is not None:
+            key = (self.gen_id, prefix.family, prefix.bitlen,
+                   bytes(prefix.addr))
+            try:
+                node = self._lpm_cache[key]
+                self._cache_hits += 1
+                return node
+            except KeyError:
+                self._cache_misses += 1
         if prefix.family == AF_INET:
             node = self._tree4.search_best(prefix)
         else:
             node = self._tree6.search_best(prefix)
-        if node and node.data is not None:
-            return node
-        else:
-            return None
+        if not (node and node._data is not None):
+            node = None
+        if self._lpm_cache is not None:
+            if len(self._lpm_cache) >= self._lpm_cache_size:
+                self._lpm_cache.clear()
+            self._lpm_cache[key] = node
+        return node
+
+    def search_best_many(self, addresses):
+        results = []
+        for address in addresses:
+            if isinstance(address, bytes):
+                results.append(self.search_best(packed=address))
+            else:
+                results.append(self.search_best(address))
+        return results
+
+    def search_best_packed(self, packed, prefixlen=-1):
+        return self.search_best(
+            packed=packed, masklen=None if prefixlen < 0 else prefixlen)
+
+    def search_exact_packed(self, packed, prefixlen=-1):
+        return self.search_exact(
+            packed=packed, masklen=None if prefixlen < 0 else prefixlen)
 
     def search_worst(self, network=None, masklen=None, packed=None):
         prefix = RadixPrefix(network, masklen, packed)
@@ -478,32 +723,106 @@ class Radix(object):
             node = self._tree4.search_worst(prefix)
         else:
             node = self._tree6.search_worst(prefix)
-        if node and node.data is not None:
+        if node and node._data is not None:
             return node
         else:
             return None
 
-    def search_covered(self, network=None, masklen=None, packed=None):
+    def search_covered(self, network=None, masklen=None, packed=None,
+                       form='nodes'):
+        if form not in ('nodes', 'prefixes', 'count'):
+            raise ValueError("form must be 'nodes', 'prefixes' or 'count'")
         prefix = RadixPrefix(network, masklen, packed)
         if prefix.family == AF_INET:
-            return self._tree4.search_covered(prefix)
+            nodes = self._tree4.search_covered(prefix)
         else:
-            return self._tree6.search_covered(prefix)
+            nodes = self._tree6.search_covered(prefix)
+        if form == 'count':
+            return len(nodes)
+        if form == 'prefixes':
+            return [str(node._prefix) for node in nodes]
+        return nodes
 
     def search_covering(self, network=None, masklen=None, packed=None):
         node = self.search_best(network=network, masklen=masklen,
                                 packed=packed)
         stack = []
         while node is not None:
-            if node._prefix.addr and node.data is not None:
+            if node._prefix.addr and node._data is not None:
                 stack.append(node)
             node = node.parent
         return stack
 
+    def snapshot(self):
+        order = []
+        recs = []
+
+        def _append(node, parent_idx):
+            order.append(node)
+            recs.append([node.bitlen or 0, 0, 0, parent_idx, 0, 0, b''])
+            return len(order)
+
+        head4_idx = head6_idx = 0
+        if self._tree4.head is not None:
+            head4_idx = _append(self._tree4.head, 0)
+        if self._tree6.head is not None:
+            head6_idx = _append(self._tree6.head, 0)
+        i = 0
+        while i < len(order):
+            node = order[i]
+            rec = recs[i]
+            prefix = node._prefix
+            if prefix.addr is not None:
+                rec[4] = 4 if prefix.family == AF_INET else 6
+                rec[5] = prefix.bitlen
+                rec[6] = bytes(prefix.addr)
+            if node.left is not None:
+                rec[1] = _append(node.left, i + 1)
+            if node.right is not None:
+                rec[2] = _append(node.right, i + 1)
+            i += 1
+
+        parts = [_SNAP_HDR.pack(_SNAP_MAGIC, _SNAP_VERSION, len(order),
+                                head4_idx, head6_idx)]
+        for rec in recs:
+            parts.append(_SNAP_NODE.pack(*rec))
+        return b''.join(parts)
+
+    def load_snapshot(self, buf):
+        if self._frozen:
+            raise RuntimeError(
+                'Radix tree is frozen (call unfreeze() to modify)')
+        if self._tree4.head is not None or self._tree6.head is not None:
+            raise ValueError('load_snapshot() requires an empty tree')
+        data = bytes(buf)
+        if len(data) < _SNAP_HDR.size:
+            raise ValueError('invalid or corrupt snapshot')
+        magic, version, count, _, _ = _SNAP_HDR.unpack_from(data)
+        if (magic != _SNAP_MAGIC or version != _SNAP_VERSION or
+                len(data) != _SNAP_HDR.size + count * _SNAP_NODE.size):
+            raise ValueError('invalid or corrupt snapshot')
+        # links are 1-based and BFS order puts children after their
+        # parent; reject self/back links like the C loader before
+        # touching the tree
+        for i in range(count):
+            _, left, right, _, _, _, _ = _SNAP_NODE.unpack_from(
+                data, _SNAP_HDR.size + i * _SNAP_NODE.size)
+            if (left != 0 and not i + 1 < left <= count) or (
+                    right != 0 and not i + 1 < right <= count):
+                raise ValueError('invalid or corrupt snapshot')
+        # re-insert the real prefixes; the glue structure rebuilds itself
+        for i in range(count):
+            _, _, _, _, family, bitlen, addr = _SNAP_NODE.unpack_from(
+                data, _SNAP_HDR.size + i * _SNAP_NODE.size)
+            if family == 4:
+                self.add(packed=addr[:4], masklen=bitlen)
+            elif family == 6:
+                self.add(packed=addr, masklen=bitlen)
+
     def _iter(self, node):
         stack = []
         while node is not None:
-            if node._prefix.addr and node.data is not None:
+            if node._prefix.addr and node._data is not None:
                 yield node
             if node.left:
                 if node.right:
@@ -518,12 +837,254 @@ class Radix(object):
                 break
         return
 
+    def iternodes(self, family=0, within=None, minlen=-1, maxlen=-1):
+        # Validate up front so bad arguments raise at call time, as the
+        # C extension does, not on the first next().
+        if family not in (0, AF_INET, AF_INET6):
+            raise ValueError('family must be AF_INET or AF_INET6')
+        wprefix = None
+        if within is not None:
+            wprefix = RadixPrefix(within)
+            if family not in (0, wprefix.family):
+                raise ValueError('within prefix does not match family')
+            family = wprefix.family
+        return self._iternodes(family, wprefix, minlen, maxlen)
+
+    def _iternodes(self, family, wprefix, minlen, maxlen):
+        init_id = self.gen_id
+        if family in (0, AF_INET):
+            heads = [self._tree4.head]
+        else:
+            heads = []
+        if family in (0, AF_INET6):
+            heads.append(self._tree6.head)
+        for head in heads:
+            for elt in self._iter(head):
+                if init_id != self.gen_id:
+                    raise RuntimeWarning(
+                        'detected modification during iteration')
+                bitlen = elt.prefixlen
+                if minlen >= 0 and bitlen < minlen:
+                    continue
+                if maxlen >= 0 and bitlen > maxlen:
+                    continue
+                if wprefix is not None and (
+                        bitlen < wprefix.bitlen or
+                        not self._tree4._prefix_match(
+                            elt._prefix, wprefix, wprefix.bitlen)):
+                    continue
+                yield elt
+
+    def aggregate(self, key=None):
+        agg = Radix(self._value_mode)
+
+        def bit_set(addr, bit):
+            return addr[bit >> 3] & (0x80 >> (bit & 0x07))
+
+        def match(a, b, bits):
+            quotient, remainder = divmod(bits, 8)
+            if a[:quotient] != b[:quotient]:
+                return False
+            if remainder == 0:
+                return True
+            mask = (0xff << (8 - remainder)) & 0xff
+            return (a[quotient] ^ b[quotient]) & mask == 0
+
+        # The walk is preorder (sorted, covering prefixes first), so a
+        # stack of pending prefixes is enough to drop covered entries
+        # and merge buddy pairs into their parent in one pass.
+        for head in [self._tree4.head, self._tree6.head]:
+            stack = []
+            for node in self._iter(head):
+                addr = bytes(node._prefix.addr)
+                bitlen = node.prefixlen
+                if key is not None:
+                    nkey = key(node.value if self._value_mode == 'object'
+                               else node.data)
+                else:
+                    nkey = None
+
+                # finalize entries this prefix has moved past
+                while stack:
+                    eaddr, ebitlen, _ekey = stack[-1]
+                    if ebitlen == 0 or match(eaddr, addr, ebitlen):
+                        break       # still an ancestor
+                    if not bit_set(eaddr, ebitlen - 1) and \
+                            match(eaddr, addr, ebitlen - 1):
+                        break       # its buddy may still arrive
+                    agg.add(packed=eaddr, masklen=ebitlen)
+                    stack.pop()
+
+                # covered by the nearest kept ancestor?
+                covered = False
+                for eaddr, ebitlen, ekey in reversed(stack):
+                    if ebitlen > bitlen or not match(eaddr, addr, ebitlen):
+                        continue
+                    covered = (ekey == nkey)
+                    break
+                if covered:
+                    continue
+                stack.append((addr, bitlen, nkey))
+
+                # merge buddy pairs into their parent
+                while len(stack) >= 2:
+                    aaddr, abitlen, akey = stack[-2]
+                    baddr, bbitlen, bkey = stack[-1]
+                    if abitlen == 0 or abitlen != bbitlen:
+                        break
+                    if bit_set(aaddr, abitlen - 1) or \
+                            not bit_set(baddr, bbitlen - 1):
+                        break
+                    if not match(aaddr, baddr, abitlen - 1) or akey != bkey:
+                        break
+                    stack.pop()
+                    stack.pop()
+                    stack.append((aaddr, abitlen - 1, akey))
+
+            for eaddr, ebitlen, _ekey in stack:
+                agg.add(packed=eaddr, masklen=ebitlen)
+
+        return agg
+
+    def stats(self):
+        stats = {
+            # the pure-Python tree has no slab allocator to measure
+            'node_bytes': 0,
+            'prefix_bytes': 0,
+            'inserts': self._inserts,
+            'deletes': self._deletes,
+            'lookups': self._lookups,
+        }
+        for name, tree in [('ipv4', self._tree4), ('ipv6', self._tree6)]:
+            prefixes = glue = 0
+            hist = []
+            stack = [(tree.head, 0)] if tree.head else []
+            while stack:
+                node, depth = stack.pop()
+                if len(hist) <= depth:
+                    hist.extend([0] * (depth + 1 - len(hist)))
+                hist[depth] += 1
+                if node._prefix.addr is None:
+                    glue += 1
+                else:
+                    prefixes += 1
+                if node.left:
+                    stack.append((node.left, depth + 1))
+                if node.right:
+                    stack.append((node.right, depth + 1))
+            stats[name] = {
+                'prefixes': prefixes,
+                'glue': glue,
+                'depth_hist': hist,
+            }
+        if self._lpm_cache is not None:
+            stats['cache_hits'] = self._cache_hits
+            stats['cache_misses'] = self._cache_misses
+        return stats
+
+    def union(self, other):
+        res = Radix()
+        for node in self:
+            res.add(packed=node.packed, masklen=node.prefixlen)
+        for node in other:
+            res.add(packed=node.packed, masklen=node.prefixlen)
+        return res
+
+    def intersection(self, other):
+        res = Radix()
+        for node in self:
+            if other.search_exact(packed=node.packed,
+                                  masklen=node.prefixlen):
+                res.add(packed=node.packed, masklen=node.prefixlen)
+        return res
+
+    def difference(self, other):
+        res = Radix()
+        for node in self:
+            if not other.search_exact(packed=node.packed,
+                                      masklen=node.prefixlen):
+                res.add(packed=node.packed, masklen=node.prefixlen)
+        return res
+
     def nodes(self):
         return [elt for elt in self]
 
     def prefixes(self):
         return [str(elt._prefix) for elt in self]
 
+    def __len__(self):
+        return self._prefix_count
+
+    def __contains__(self, key):
+        if isinstance(key, bytes):
+            return self.search_exact(packed=key) is not None
+        return self.search_exact(key) is not None
+
+    def __getitem__(self, key):
+        if isinstance(key, bytes):
+            node = self.search_exact(packed=key)
+        else:
+            node = self.search_exact(key)
+        if node is None:
+            raise KeyError(key)
+        if self._value_mode == 'object':
+            return node.value
+        return node.data
+
+    def __setitem__(self, key, value):
+        if self._value_mode != 'object' and not isinstance(value, dict):
+            raise TypeError('Radix node data must be a dict')
+        if isinstance(key, bytes):
+            node = self.add(packed=key)
+        else:
+            node = self.add(key)
+        if self._value_mode == 'object':
+            node.value = value
+        else:
+            node.data = value
+
+    def __delitem__(self, key):
+        if isinstance(key, bytes):
+            self.delete(packed=key)
+        else:
+            self.delete(key)
+
+    def __getstate__(self):
+        # Same compact format as the C extension: a record blob of
+        # (family, bitlen, address bytes) per prefix in walk order,
+        # plus the data dicts in the same order.
+        blob = bytearray()
+        data = []
+        for node in self:
+            packed = node.packed
+            blob.append(6 if len(packed) == 16 else 4)
+            blob.append(node.prefixlen)
+            blob += packed
+            if self._value_mode == 'object':
+                data.append(node.value)
+            else:
+                data.append(node.data if node.data else None)
+        return (bytes(blob), data)
+
+    def __setstate__(self, state):
+        blob, data = state
+        pos = 0
+        for node_data in data:
+            alen = 16 if blob[pos] == 6 else 4
+            node = self.add(packed=blob[pos + 2:pos + 2 + alen],
+                            masklen=blob[pos + 1])
+            if node_data is not None:
+                if self._value_mode == 'object':
+                    node.value = node_data
+                else:
+                    node.data = node_data
+            pos += 2 + alen
+
+    def __reduce__(self):
+        if self._value_mode == 'object':
+            return (self.__class__, ('object',), self.__getstate__())
+        return (self.__class__, (), self.__getstate__())
+
     def __iter__(self):
         init_id = self.gen_id
         for elt in self._iter(self._tree4.head):
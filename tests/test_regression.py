@@ -16,6 +16,7 @@
 
 # $Id$
 
+import os
 import pickle
 import platform
 import radix
@@ -481,6 +482,494 @@ class TestRadix(unittest.TestCase):
         node1 = tree.add('10.0.0.0/24')
         self.assertEqual(node1.parent, parent_node)
 
+    def test_54_add_many(self):
+        tree = radix.Radix()
+        count = tree.add_many(['10.0.0.0/8', '10.0.1.0/24',
+                               '2001:db8::/32', t14_packed_addr])
+        self.assertEqual(count, 4)
+        self.assertEqual(
+            sorted(tree.prefixes()),
+            ['10.0.0.0/8', '10.0.1.0/24', '2001:db8::/32',
+             '224.20.11.64/32'])
+        self.assertNotEqual(tree.search_exact('10.0.1.0/24'), None)
+        self.assertRaises(ValueError, tree.add_many, ['not-an-address'])
+        self.assertRaises(TypeError, tree.add_many, [42])
+
+    def test_33_search_best_many(self):
+        tree = radix.Radix()
+        tree.add('10.0.0.0/8')
+        tree.add('10.0.1.0/24')
+        tree.add('2001:db8::/32')
+        results = tree.search_best_many(
+            ['10.0.1.10', '10.1.2.3', '172.16.0.1',
+             '2001:db8::1', t14_packed_addr])
+        self.assertEqual(
+            [n.prefix if n else None for n in results],
+            ['10.0.1.0/24', '10.0.0.0/8', None, '2001:db8::/32', None])
+        self.assertEqual(tree.search_best_many([]), [])
+        self.assertRaises(ValueError, tree.search_best_many, ['bogus'])
+
+    def test_34_node_attributes_after_delete(self):
+        tree = radix.Radix()
+        node = tree.add('10.0.1.0/24')
+        node.data['one'] = 1
+        tree.delete('10.0.1.0/24')
+        tree.add('192.168.0.0/16')
+        # the node object keeps its identity after removal from the tree
+        self.assertEqual(node.prefix, '10.0.1.0/24')
+        self.assertEqual(node.network, '10.0.1.0')
+        self.assertEqual(node.prefixlen, 24)
+        self.assertEqual(node.family, socket.AF_INET)
+        self.assertEqual(node.packed, struct.pack('4B', 10, 0, 1, 0))
+        self.assertEqual(node.data['one'], 1)
+
+    def test_35_search_packed(self):
+        tree = radix.Radix()
+        tree.add('10.0.0.0/8')
+        tree.add('10.0.1.0/24')
+        addr = struct.pack('4B', 10, 0, 1, 20)
+        self.assertEqual(
+            tree.search_best_packed(addr).prefix, '10.0.1.0/24')
+        self.assertEqual(
+            tree.search_best_packed(addr, 16).prefix, '10.0.0.0/8')
+        self.assertEqual(
+            tree.search_exact_packed(struct.pack('4B', 10, 0, 1, 0),
+                                     24).prefix, '10.0.1.0/24')
+        self.assertEqual(tree.search_exact_packed(addr), None)
+        self.assertEqual(
+            tree.search_best_packed(struct.pack('4B', 192, 0, 2, 1)), None)
+        self.assertRaises(ValueError, tree.search_best_packed, b'\x01\x02')
+
+    def test_36_freeze(self):
+        tree = radix.Radix()
+        tree.add_many(['10.0.0.0/8', '10.0.1.0/24', '172.16.0.0/12',
+                       '2001:db8::/32', '0.0.0.0/0'])
+        node = tree.search_exact('10.0.1.0/24')
+        node.data['one'] = 1
+        tree.freeze()
+        # searches keep working against the compacted layout
+        self.assertEqual(tree.search_best('10.0.1.5').prefix, '10.0.1.0/24')
+        self.assertEqual(tree.search_best('11.1.1.1').prefix, '0.0.0.0/0')
+        self.assertEqual(tree.search_best('2001:db8::1').prefix,
+                         '2001:db8::/32')
+        self.assertEqual(tree.search_exact('10.0.1.0/24').data['one'], 1)
+        self.assertEqual(len(tree.nodes()), 5)
+        self.assertEqual(tree.search_exact('10.0.1.0/24').parent.prefix,
+                         '10.0.0.0/8')
+        # modification is refused while frozen
+        self.assertRaises(RuntimeError, tree.add, '192.168.0.0/16')
+        self.assertRaises(RuntimeError, tree.delete, '10.0.0.0/8')
+        tree.unfreeze()
+        tree.add('192.168.0.0/16')
+        self.assertEqual(len(tree.nodes()), 6)
+
+    def test_37_frozen_stride_lookup(self):
+        # exercise the direct-index IPv4 engine against the plain walk
+        tree = radix.Radix()
+        prefixes = ['0.0.0.0/0', '10.0.0.0/8', '10.128.0.0/9',
+                    '10.128.0.0/16', '10.128.64.0/18', '10.128.64.12/30',
+                    '172.16.0.0/12', '192.0.2.0/24', '8.0.0.0/6']
+        tree.add_many(prefixes)
+        queries = ['10.128.64.12', '10.128.64.200', '10.128.1.1',
+                   '10.200.0.1', '10.1.2.3', '172.16.99.1', '192.0.2.255',
+                   '192.0.3.1', '9.9.9.9', '203.0.113.5', '10.128.0.0/16',
+                   '10.128.64.12/32']
+        before = [n.prefix if n else None
+                  for n in tree.search_best_many(queries)]
+        tree.freeze()
+        after = [n.prefix if n else None
+                 for n in tree.search_best_many(queries)]
+        self.assertEqual(before, after)
+        self.assertEqual(tree.search_best('10.128.64.13').prefix,
+                         '10.128.64.12/30')
+        # short (< /16) queries still use the ordinary walk
+        self.assertEqual(tree.search_best('10.0.0.0/8').prefix,
+                         '10.0.0.0/8')
+
+    def test_38_snapshot_roundtrip(self):
+        import tempfile
+        import os
+        tree = radix.Radix()
+        tree.add_many(['10.0.0.0/8', '10.0.1.0/24', '172.16.0.0/12',
+                       '2001:db8::/32', '::/0', '0.0.0.0/0'])
+        blob = tree.snapshot()
+        restored = radix.Radix()
+        restored.load_snapshot(blob)
+        self.assertEqual(sorted(tree.prefixes()),
+                         sorted(restored.prefixes()))
+        self.assertEqual(restored.search_best('10.0.1.5').prefix,
+                         '10.0.1.0/24')
+        self.assertEqual(restored.search_best('2001:db8::1').prefix,
+                         '2001:db8::/32')
+        # loading requires an empty tree, and garbage is rejected
+        self.assertRaises(ValueError, restored.load_snapshot, blob)
+        empty = radix.Radix()
+        self.assertRaises(ValueError, empty.load_snapshot, b'garbage')
+        # a snapshot with a self/back link would build a cyclic tree;
+        # it must be rejected, not hang the next search
+        bad = bytearray(blob)
+        struct.pack_into('=I', bad, 24, 1)  # record 0 left child -> itself
+        self.assertRaises(ValueError, radix.Radix().load_snapshot,
+                          bytes(bad))
+        # save()/load() round-trip through a file
+        fd, path = tempfile.mkstemp()
+        os.close(fd)
+        try:
+            tree.save(path)
+            loaded = radix.load(path)
+            self.assertEqual(sorted(tree.prefixes()),
+                             sorted(loaded.prefixes()))
+        finally:
+            os.unlink(path)
+
+    def test_39_concurrent_batch_readers(self):
+        import threading
+        tree = radix.Radix()
+        tree.add_many(['10.0.0.0/8', '10.0.1.0/24', '172.16.0.0/12',
+                       '0.0.0.0/0'])
+        tree.freeze()
+        queries = ['10.0.1.%d' % i for i in range(256)] * 40
+        expected = [n.prefix for n in tree.search_best_many(queries)]
+        results = {}
+
+        def worker(idx):
+            results[idx] = [n.prefix
+                            for n in tree.search_best_many(queries)]
+
+        threads = [threading.Thread(target=worker, args=(i,))
+                   for i in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        for i in range(4):
+            self.assertEqual(results[i], expected)
+        # the reader count is restored, so writes work again
+        tree.unfreeze()
+        tree.add('192.168.0.0/16')
+
+    def test_40_update(self):
+        tree = radix.Radix()
+        tree.add_many(['10.0.0.0/8', '172.16.0.0/12', '192.168.0.0/16'])
+        tree.update(
+            adds=[('10.1.0.0/16', {'origin': 64496}), '2001:db8::/32'],
+            deletes=['172.16.0.0/12'])
+        self.assertEqual(sorted(tree.prefixes()),
+                         ['10.0.0.0/8', '10.1.0.0/16', '192.168.0.0/16',
+                          '2001:db8::/32'])
+        node = tree.search_exact('10.1.0.0/16')
+        self.assertEqual(node.data['origin'], 64496)
+        # data merges into an existing node
+        tree.update(adds=[('10.1.0.0/16', {'med': 100})])
+        self.assertEqual(node.data, {'origin': 64496, 'med': 100})
+        # deleting a missing prefix fails but keeps the tree usable
+        self.assertRaises(KeyError, tree.update,
+                          deletes=['203.0.113.0/24'])
+        self.assertNotEqual(tree.search_exact('10.0.0.0/8'), None)
+
+    def test_41_iternodes(self):
+        tree = radix.Radix()
+        tree.add_many(['10.0.0.0/8', '10.0.0.0/20', '10.0.1.0/24',
+                       '10.128.0.0/24', '172.16.0.0/12',
+                       '2001:db8::/32', '2001:db8::/64'])
+        self.assertEqual(
+            sorted(n.prefix for n in tree.iternodes()),
+            sorted(tree.prefixes()))
+        self.assertEqual(
+            sorted(n.prefix for n in tree.iternodes(family=socket.AF_INET6)),
+            ['2001:db8::/32', '2001:db8::/64'])
+        self.assertEqual(
+            sorted(n.prefix for n in tree.iternodes(within='10.0.0.0/8')),
+            ['10.0.0.0/20', '10.0.0.0/8', '10.0.1.0/24', '10.128.0.0/24'])
+        self.assertEqual(
+            sorted(n.prefix for n in tree.iternodes(
+                within='10.0.0.0/8', minlen=20, maxlen=24)),
+            ['10.0.0.0/20', '10.0.1.0/24', '10.128.0.0/24'])
+        self.assertEqual(
+            [n.prefix for n in tree.iternodes(within='192.0.2.0/24')], [])
+        self.assertRaises(ValueError, tree.iternodes, family=99)
+
+    def test_42_aggregate(self):
+        tree = radix.Radix()
+        tree.add_many(['10.0.0.0/24', '10.0.1.0/24', '10.0.2.0/23',
+                       '10.1.0.0/16', '10.1.2.0/24', '192.0.2.0/25',
+                       '2001:db8::/33', '2001:db8:8000::/33'])
+        agg = tree.aggregate()
+        self.assertEqual(sorted(agg.prefixes()),
+                         ['10.0.0.0/22', '10.1.0.0/16', '192.0.2.0/25',
+                          '2001:db8::/32'])
+        # original tree is untouched
+        self.assertEqual(len(tree.prefixes()), 8)
+        # with a key, only equal-keyed prefixes merge or collapse
+        tree = radix.Radix()
+        for prefix, asn in [('10.0.0.0/24', 1), ('10.0.1.0/24', 1),
+                            ('10.0.2.0/24', 2), ('10.0.0.0/16', 1),
+                            ('10.0.3.0/24', 2)]:
+            tree.add(prefix).data['asn'] = asn
+        agg = tree.aggregate(key=lambda data: data['asn'])
+        self.assertEqual(sorted(agg.prefixes()),
+                         ['10.0.0.0/16', '10.0.2.0/23'])
+
+    def test_43_set_operations(self):
+        a = radix.Radix()
+        a.add_many(['10.0.0.0/8', '10.0.0.0/24', '172.16.0.0/12',
+                    '2001:db8::/32'])
+        b = radix.Radix()
+        b.add_many(['10.0.0.0/24', '192.168.0.0/16', '2001:db8::/32',
+                    '2001:db8::/64'])
+        self.assertEqual(sorted(a.union(b).prefixes()),
+                         ['10.0.0.0/24', '10.0.0.0/8', '172.16.0.0/12',
+                          '192.168.0.0/16', '2001:db8::/32',
+                          '2001:db8::/64'])
+        self.assertEqual(sorted(a.intersection(b).prefixes()),
+                         ['10.0.0.0/24', '2001:db8::/32'])
+        self.assertEqual(sorted(a.difference(b).prefixes()),
+                         ['10.0.0.0/8', '172.16.0.0/12'])
+        self.assertEqual(sorted(b.difference(a).prefixes()),
+                         ['192.168.0.0/16', '2001:db8::/64'])
+
+    def test_44_stats(self):
+        tree = radix.Radix()
+        tree.add_many(['10.0.0.0/8', '10.1.0.0/16', '10.2.0.0/16',
+                       '2001:db8::/32'])
+        tree.delete('10.2.0.0/16')
+        tree.search_best('10.1.2.3')
+        tree.search_best('10.99.0.1')
+        st = tree.stats()
+        self.assertEqual(st['ipv4']['prefixes'], 2)
+        self.assertEqual(st['ipv6']['prefixes'], 1)
+        self.assertEqual(st['inserts'], 4)
+        self.assertEqual(st['deletes'], 1)
+        self.assertEqual(st['lookups'], 2)
+        self.assertEqual(sum(st['ipv4']['depth_hist']),
+                         st['ipv4']['prefixes'] + st['ipv4']['glue'])
+        self.assertEqual(st['ipv6']['glue'], 0)
+        self.assertEqual(st['ipv6']['depth_hist'], [1])
+
+    def test_45_len_contains_mapping(self):
+        tree = radix.Radix()
+        self.assertEqual(len(tree), 0)
+        tree.add_many(['10.0.0.0/8', '2001:db8::/32'])
+        self.assertEqual(len(tree), 2)
+        self.assertTrue('10.0.0.0/8' in tree)
+        self.assertFalse('10.0.0.0/9' in tree)
+        tree['192.0.2.0/24'] = {'tag': 'doc'}
+        self.assertEqual(len(tree), 3)
+        self.assertEqual(tree['192.0.2.0/24'], {'tag': 'doc'})
+        node = tree.add('10.0.0.0/8')
+        node.data['x'] = 1
+        self.assertEqual(tree['10.0.0.0/8'], {'x': 1})
+        self.assertRaises(KeyError, lambda: tree['172.16.0.0/12'])
+        self.assertRaises(TypeError, tree.__setitem__, '10.0.0.0/8', 42)
+        del tree['192.0.2.0/24']
+        self.assertEqual(len(tree), 2)
+        self.assertRaises(KeyError, tree.__delitem__, '192.0.2.0/24')
+        tree.delete('10.0.0.0/8')
+        tree.delete('2001:db8::/32')
+        self.assertEqual(len(tree), 0)
+
+    def test_46_pickle_fast_state(self):
+        tree = radix.Radix()
+        tree.add('10.0.0.0/8')
+        node = tree.add('2001:db8::/32')
+        node.data['origin'] = 64496
+        tree2 = pickle.loads(pickle.dumps(tree))
+        self.assertEqual(tree.prefixes(), tree2.prefixes())
+        self.assertEqual(tree2.search_exact('2001:db8::/32').data,
+                         {'origin': 64496})
+        self.assertEqual(tree2.search_exact('10.0.0.0/8').data, {})
+        # pickles from 0.10 and earlier carried a list of (prefix, data)
+        old = radix.Radix()
+        old.__setstate__([('10.0.0.0/8', {'a': 1})])
+        self.assertEqual(old['10.0.0.0/8'], {'a': 1})
+
+    def test_47_shared_memory(self):
+        try:
+            from multiprocessing import shared_memory  # noqa: F401
+        except ImportError:
+            self.skipTest('multiprocessing.shared_memory unavailable')
+        tree = radix.Radix()
+        tree.add('10.0.0.0/8')
+        tree.add('10.1.0.0/16')
+        tree.add('2001:db8::/32')
+        name = 'py-radix-test-%d' % os.getpid()
+        shm = tree.to_shared_memory(name)
+        try:
+            view = radix.attach_shared(name)
+            self.assertEqual(len(view), 3)
+            self.assertEqual(view.search_best('10.1.2.3'), '10.1.0.0/16')
+            self.assertEqual(view.search_best('10.200.0.1'), '10.0.0.0/8')
+            self.assertEqual(view.search_best('2001:db8::1'),
+                             '2001:db8::/32')
+            self.assertEqual(view.search_best('192.0.2.1'), None)
+            view.close()
+        finally:
+            shm.close()
+            shm.unlink()
+
+    def test_48_async_radix(self):
+        try:
+            import asyncio
+        except ImportError:
+            self.skipTest('asyncio unavailable')
+        tree = radix.Radix()
+        tree.add('10.0.0.0/8')
+        tree.add('10.1.0.0/16')
+        tree.add('2001:db8::/32')
+        tree.freeze()
+        aradix = radix.AsyncRadix(tree)
+
+        async def run():
+            return await asyncio.gather(
+                aradix.search_best('10.1.2.3'),
+                aradix.search_best('10.200.0.1'),
+                aradix.search_best('2001:db8::1'),
+                aradix.search_best('192.0.2.1'))
+
+        results = asyncio.run(run())
+        self.assertEqual(
+            [node.prefix if node else None for node in results],
+            ['10.1.0.0/16', '10.0.0.0/8', '2001:db8::/32', None])
+
+    def test_49_node_children_subtree(self):
+        tree = radix.Radix()
+        tree.add('10.0.0.0/8')
+        tree.add('10.0.0.0/16')
+        tree.add('10.0.0.0/24')
+        tree.add('10.1.0.0/16')
+        tree.add('192.0.2.0/24')
+        node = tree.search_exact('10.0.0.0/8')
+        self.assertEqual(
+            sorted(n.prefix for n in node.children()),
+            ['10.0.0.0/16', '10.1.0.0/16'])
+        self.assertEqual(
+            [n.prefix for n in node.subtree()],
+            ['10.0.0.0/16', '10.0.0.0/24', '10.1.0.0/16'])
+        leaf = tree.search_exact('10.0.0.0/24')
+        self.assertEqual(leaf.children(), [])
+        self.assertEqual(leaf.subtree(), [])
+        tree.delete('10.0.0.0/24')
+        self.assertEqual(leaf.subtree(), [])
+
+    def test_50_load_text(self):
+        import tempfile
+        fd, path = tempfile.mkstemp()
+        os.close(fd)
+        try:
+            with open(path, 'w') as f:
+                f.write('# a RIB dump\n'
+                        '10.0.0.0/8 65001\n'
+                        '\n'
+                        '192.0.2.0/24 65002\n'
+                        '2001:db8::/32 65003\n'
+                        '203.0.113.1 65004\n')
+            tree = radix.Radix()
+            self.assertEqual(tree.load_text(path), 4)
+            self.assertEqual(len(tree), 4)
+            self.assertEqual(tree.search_best('10.1.2.3').prefix,
+                             '10.0.0.0/8')
+            self.assertEqual(tree.search_exact('203.0.113.1/32').prefix,
+                             '203.0.113.1/32')
+            # column selection with a custom delimiter
+            with open(path, 'w') as f:
+                f.write('r1,172.16.0.0/12\nr2,2001:db8:1::/48\n')
+            tree2 = radix.Radix()
+            self.assertEqual(tree2.load_text(path, column=1,
+                                             delimiter=','), 2)
+            self.assertNotEqual(tree2.search_exact('172.16.0.0/12'), None)
+            # a bad line reports its number; earlier lines stay inserted
+            with open(path, 'w') as f:
+                f.write('10.0.0.0/8\nnot-a-prefix\n')
+            tree3 = radix.Radix()
+            with self.assertRaises(ValueError) as cm:
+                tree3.load_text(path)
+            self.assertTrue(str(cm.exception).startswith('line 2:'))
+            self.assertNotEqual(tree3.search_exact('10.0.0.0/8'), None)
+        finally:
+            os.unlink(path)
+
+    def test_51_value_mode_object(self):
+        self.assertRaises(ValueError, radix.Radix, value_mode='bogus')
+        tree = radix.Radix(value_mode='object')
+        node = tree.add('10.0.0.0/8')
+        self.assertEqual(node.value, None)
+        node.value = 65001
+        self.assertEqual(node.value, 65001)
+        tree['192.0.2.0/24'] = 'policy-7'
+        self.assertEqual(tree['10.0.0.0/8'], 65001)
+        self.assertEqual(tree['192.0.2.0/24'], 'policy-7')
+        self.assertEqual(tree.search_best('10.1.2.3').value, 65001)
+        # no data dict in object mode, and no value slot in dict mode
+        with self.assertRaises(TypeError):
+            node.data
+        dtree = radix.Radix()
+        dnode = dtree.add('10.0.0.0/8')
+        with self.assertRaises(TypeError):
+            dnode.value
+        # pickling preserves the mode and the stored values
+        tree2 = pickle.loads(pickle.dumps(tree))
+        self.assertEqual(tree2['192.0.2.0/24'], 'policy-7')
+        self.assertEqual(tree2.search_exact('10.0.0.0/8').value, 65001)
+        tree2['192.0.2.0/24'] = 'policy-8'
+        self.assertEqual(tree2['192.0.2.0/24'], 'policy-8')
+
+    def test_52_parallel_build(self):
+        prefixes = ['%d.%d.0.0/16' % (i, j)
+                    for i in range(1, 40) for j in range(8)]
+        prefixes += ['10.0.0.0/8', '10.1.0.0/16', '2001:db8::/32',
+                     '2001:db8:1::/48', '0.0.0.0/0', '8.0.0.0/6']
+        serial = radix.Radix()
+        serial.add_many(prefixes)
+        for threads in (1, 4):
+            tree = radix.Radix()
+            self.assertEqual(tree.build(prefixes, threads=threads),
+                             len(prefixes))
+            self.assertEqual(tree.prefixes(), serial.prefixes())
+            self.assertEqual(tree.search_best('10.1.2.3').prefix,
+                             '10.1.0.0/16')
+            self.assertEqual(tree.search_best('2001:db8:1::1').prefix,
+                             '2001:db8:1::/48')
+            self.assertEqual(tree.search_best('200.1.2.3').prefix,
+                             '0.0.0.0/0')
+            tree.delete('10.1.0.0/16')
+            self.assertEqual(tree.search_best('10.1.2.3').prefix,
+                             '10.0.0.0/8')
+        nonempty = radix.Radix()
+        nonempty.add('192.0.2.0/24')
+        self.assertRaises(ValueError, nonempty.build, prefixes)
+        self.assertRaises(ValueError, radix.Radix().build, [], threads=0)
+
+    def test_53_clear(self):
+        import time
+        tree = radix.Radix()
+        tree.add_many(['10.%d.0.0/16' % i for i in range(100)])
+        node = tree.search_exact('10.5.0.0/16')
+        node.data['x'] = 1
+        tree.clear()
+        self.assertEqual(len(tree), 0)
+        self.assertEqual(tree.search_best('10.5.0.1'), None)
+        self.assertEqual(node.parent, None)   # detached, still valid
+        self.assertEqual(node.data['x'], 1)
+        tree.add('192.0.2.0/24')
+        self.assertEqual(len(tree), 1)
+        # clearing is allowed on a frozen tree and unfreezes it
+        tree.freeze()
+        tree.clear()
+        tree.add('10.0.0.0/8')
+        # deferred clear: tree is empty and reusable immediately
+        tree.add_many(['10.%d.0.0/16' % i for i in range(100)])
+        held = tree.search_exact('10.7.0.0/16')
+        tree.clear(defer=True)
+        self.assertEqual(len(tree), 0)
+        tree.add('10.9.0.0/16')
+        self.assertEqual(tree.search_best('10.9.1.1').prefix,
+                         '10.9.0.0/16')
+        for _ in range(100):   # reaper detaches the old nodes
+            if held.parent is None:
+                break
+            time.sleep(0.01)
+        self.assertEqual(held.parent, None)
+
     def test_32_covering_with_delete_error(self):
         tree = radix.Radix()
         tree.add('91.187.124.0/24')